@@ -14,18 +14,23 @@
 #include <linux/list.h>
 #include <linux/cdev.h>
 #include <linux/poll.h>
+#include <linux/device.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
+#include <linux/seqlock.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-trace.h"
 #include "lunix-chrdev.h"
+#include "lunix-format.h"
 #include "lunix-lookup.h"
 
 
@@ -34,6 +39,141 @@
  */
 struct cdev lunix_chrdev_cdev;
 
+/*
+ * Open state of the sensor nodes. Files are opened and closed all
+ * the time, so keep them in a cache of their own, which also shows
+ * up on its own in /proc/slabinfo.
+ */
+static struct kmem_cache *lunix_chrdev_state_cache;
+
+/*
+ * Device nodes are created as sensors show up, through this class
+ */
+static struct class *lunix_chrdev_class;
+
+/*
+ * Converts a raw 16-bit sensor value to milli-units.
+ *
+ * The lookup tables only cover the range of the 10-bit ADC, values
+ * above it can only come from a corrupted packet. Convert those too,
+ * to exactly what the full tables used to hold.
+ */
+static long lunix_chrdev_convert(enum lunix_msr_enum type, uint16_t raw)
+{
+	switch (type) {
+		case BATT:
+			if (likely(raw <= LUNIX_LOOKUP_MAX))
+				return lookup_voltage[raw];
+			return LUNIX_BATT_SCALE / raw;
+		case TEMP:
+			if (likely(raw <= LUNIX_LOOKUP_MAX))
+				return lookup_temperature[raw];
+			return LUNIX_TEMP_INVALID;
+		case LIGHT:
+			return div_u64(raw * LUNIX_LIGHT_SCALE, 0xFFFF);
+		default:
+			WARN_ON(1);
+			return 0;
+	}
+}
+
+/*
+ * Whether a measurement differs enough from the last one
+ * reported to this reader to get past its deadband
+ */
+static int lunix_chrdev_deadband_passes(struct lunix_chrdev_state_struct *state, long value)
+{
+	unsigned long diff, band;
+
+	if (!state->delivered)
+		return 1;
+
+	diff = abs(value - state->last_value);
+	switch (state->deadband_mode) {
+		case LUNIX_DEADBAND_ABS:
+			band = state->deadband_width;
+			break;
+		case LUNIX_DEADBAND_PCT:
+			band = div_u64((u64)abs(state->last_value) * state->deadband_width, 100000);
+			break;
+		default:
+			return 1;
+	}
+
+	return diff > band;
+}
+
+/*
+ * Whether update gen, received at timestamp, is far enough from the
+ * last one reported to this reader to get past its rate limit
+ */
+static int lunix_chrdev_rate_passes(struct lunix_chrdev_state_struct *state,
+                                    unsigned long gen, uint64_t timestamp)
+{
+	if (!state->delivered)
+		return 1;
+	if (state->rate_decimation > 1 && gen - state->last_generation < state->rate_decimation)
+		return 0;
+	if (state->rate_interval_ms &&
+	    timestamp - state->last_timestamp < (uint64_t)state->rate_interval_ms * NSEC_PER_MSEC)
+		return 0;
+	return 1;
+}
+
+/*
+ * Mean of the measurements of every update since the last one reported
+ * to this reader, up to update gen, as far back as the sensor history
+ * goes. Falls back to raw, the value of update gen, if even that has
+ * been overwritten meanwhile.
+ */
+static long lunix_chrdev_mean(struct lunix_chrdev_state_struct *state,
+                              unsigned long gen, uint16_t raw)
+{
+	unsigned int seq;
+	unsigned long first, g;
+	struct lunix_sensor_struct *sensor;
+	long sum;
+
+	sensor = state->sensor;
+	do {
+		seq = read_seqbegin(&sensor->seqlock);
+		first = state->delivered ? state->last_generation + 1 : gen;
+		if (sensor->generation - first >= LUNIX_SENSOR_HIST)
+			first = sensor->generation - LUNIX_SENSOR_HIST + 1;
+		sum = 0;
+		for (g = first; (long)(gen - g) >= 0; g++)
+			sum += lunix_chrdev_convert(state->type,
+			                            sensor->hist[(g - 1) % LUNIX_SENSOR_HIST].values[state->type]);
+	} while (read_seqretry(&sensor->seqlock, seq));
+
+	if ((long)(gen - first) < 0)
+		return lunix_chrdev_convert(state->type, raw);
+	return sum / (long)(gen - first + 1);
+}
+
+/*
+ * The converted value of update gen, taken from the sensor text cache
+ * if a reader has already converted it. Only for hints, so a miss
+ * converts raw without filling in the cache.
+ */
+static long lunix_chrdev_peek_value(struct lunix_chrdev_state_struct *state,
+                                    uint16_t raw, unsigned long gen)
+{
+	unsigned int seq;
+	struct lunix_msr_text_struct *text;
+	long value;
+	int hit;
+
+	text = &state->sensor->text[state->type];
+	do {
+		seq = read_seqbegin(&text->seqlock);
+		hit = (text->generation == gen);
+		value = text->value;
+	} while (read_seqretry(&text->seqlock, seq));
+
+	return hit ? value : lunix_chrdev_convert(state->type, raw);
+}
+
 /*
  * Just a quick [unlocked] check to see if the cached
  * chrdev state needs to be updated from sensor measurements.
@@ -47,14 +187,172 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 	struct lunix_sensor_struct *sensor;
     // macro that is used for debugging and throws a warning if the state->sensor is null
 	WARN_ON ( !(sensor = state->sensor));
-    // if the last update for the specific sensor was more recently than the last timestamp we have saved we need to update the sensor
-	if(sensor->msr_data[state->type]->last_update > state->buf_timestamp)
+	// in queue mode, anything appended to the history since our last batch is news
+	if (state->queue)
+		return READ_ONCE(sensor->generation) != state->hist_cursor;
+    // if the sensor has seen any update since the one we have cached, we need to refresh
+	if(READ_ONCE(sensor->generation) == state->buf_generation)
 	{
-		debug("I need refreshing\n");
-		return(1);
-	}	
-	debug("Im good\n");
-	return 0; 
+		debug("Im good\n");
+		return 0;
+	}
+	// unless it comes too soon after the last one we reported; again only a hint
+	if(!lunix_chrdev_rate_passes(state, READ_ONCE(sensor->generation),
+	                             READ_ONCE(sensor->msr_data[state->type]->timestamp)))
+	{
+		debug("Rate limited\n");
+		return 0;
+	}
+	// or the new value is within our deadband; this is only a hint, the update re-checks.
+	// when reporting means, the value checked differs from the latest one, so don't guess
+	if(state->deadband_mode != LUNIX_DEADBAND_OFF && !(state->rate_flags & LUNIX_RATE_MEAN) &&
+	   !lunix_chrdev_deadband_passes(state, lunix_chrdev_peek_value(state,
+	                                        READ_ONCE(sensor->msr_data[state->type]->values[0]),
+	                                        READ_ONCE(sensor->generation))))
+	{
+		debug("Within deadband\n");
+		return 0;
+	}
+	debug("I need refreshing\n");
+	return(1);
+}
+
+static int lunix_chrdev_format_binary(unsigned char *buf, uint16_t raw,
+                                      long measurement, uint64_t time)
+{
+	struct lunix_msr_record rec = {
+		.raw       = raw,
+		.value     = measurement,
+		.timestamp = time
+	};
+
+	memcpy(buf, &rec, sizeof(rec));
+	return sizeof(rec);
+}
+
+/*
+ * Formats a single measurement into buf, according to the mode
+ * of the character device. Returns the number of bytes used,
+ * at most LUNIX_CHRDEV_BUFSZ.
+ */
+static int lunix_chrdev_format_value(struct lunix_chrdev_state_struct *state, unsigned char *buf,
+                                     uint16_t raw, long measurement, uint64_t time)
+{
+	if (state->mode & LUNIX_MODE_BINARY)
+		return lunix_chrdev_format_binary(buf, raw, measurement, time);
+
+	return lunix_chrdev_format_text(buf, measurement);
+}
+
+static int lunix_chrdev_format(struct lunix_chrdev_state_struct *state,
+                               unsigned char *buf, uint16_t raw, uint64_t time)
+{
+	return lunix_chrdev_format_value(state, buf, raw,
+	                                 lunix_chrdev_convert(state->type, raw), time);
+}
+
+/*
+ * Converts the latest value of the sensor, which is update number gen,
+ * and renders it as text into the private buffer of state. Conversion
+ * and formatting happen once per update, by whichever reader gets there
+ * first; every other open file of the same measurement copies the result
+ * out of the sensor text cache. Returns the converted value, and the
+ * length of the text in *lenp.
+ */
+static long lunix_chrdev_latest(struct lunix_chrdev_state_struct *state,
+                                uint16_t raw, unsigned long gen, int *lenp)
+{
+	unsigned int seq;
+	struct lunix_msr_text_struct *text;
+	long measurement;
+	int len, hit;
+
+	text = &state->sensor->text[state->type];
+	do {
+		seq = read_seqbegin(&text->seqlock);
+		hit = (text->generation == gen);
+		measurement = text->value;
+		len = text->len;
+		memcpy(state->buf_data, text->data, sizeof(text->data));
+	} while (read_seqretry(&text->seqlock, seq));
+
+	if (!hit) {
+		measurement = lunix_chrdev_convert(state->type, raw);
+		len = lunix_chrdev_format_text(state->buf_data, measurement);
+
+		/* Don't let a slow reader replace a newer rendering */
+		write_seqlock(&text->seqlock);
+		if ((long)(gen - text->generation) > 0) {
+			text->generation = gen;
+			text->value = measurement;
+			text->len = len;
+			memcpy(text->data, state->buf_data, sizeof(text->data));
+		}
+		write_sequnlock(&text->seqlock);
+	}
+
+	*lenp = len;
+	return measurement;
+}
+
+/*
+ * Queue mode counterpart of lunix_chrdev_state_update():
+ * formats every update in the sensor history since the last
+ * batch, accounting for any the reader has already lost.
+ */
+static int lunix_chrdev_state_update_queue(struct lunix_chrdev_state_struct *state)
+{
+	unsigned int seq;
+	unsigned long head, cursor, lost, n, i;
+	struct lunix_sensor_struct *sensor;
+	struct lunix_chrdev_queue_struct *q;
+	int lim;
+
+	sensor = state->sensor;
+	q = state->queue;
+
+	/*
+	 * Copy the raw samples out, retrying if the line discipline
+	 * published an update meanwhile, and format them afterwards.
+	 */
+	do {
+		seq = read_seqbegin(&sensor->seqlock);
+		head = sensor->generation;
+		cursor = state->hist_cursor;
+		lost = 0;
+		if (head - cursor > LUNIX_SENSOR_HIST) {
+			lost = head - cursor - LUNIX_SENSOR_HIST;
+			cursor = head - LUNIX_SENSOR_HIST;
+		}
+		n = head - cursor;
+		for (i = 0; i < n; i++)
+			q->samples[i] = sensor->hist[(cursor + i) % LUNIX_SENSOR_HIST];
+	} while (read_seqretry(&sensor->seqlock, seq));
+
+	if (n == 0) {
+		debug("Nothing to refresh\n");
+		return -EAGAIN;
+	}
+	state->overruns += lost;
+	state->hist_cursor = head;
+
+	lim = 0;
+	for (i = 0; i < n; i++)
+		lim += lunix_chrdev_format(state, q->data + lim,
+		                           q->samples[i].values[state->type],
+		                           q->samples[i].timestamp);
+	state->buf_lim = lim;
+
+	debug("batch of %lu samples, %d bytes\n", n, lim);
+	return 0;
+}
+
+/*
+ * Where the cached data of a character device live
+ */
+static unsigned char *lunix_chrdev_state_buf(struct lunix_chrdev_state_struct *state)
+{
+	return state->queue ? state->queue->data : state->buf_data;
 }
 
 /*
@@ -64,49 +362,63 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
  */
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
-	unsigned long flags; //this is used to save the state when calling spin lock/unlock irq save 
+	unsigned int seq; //sequence count of the sensor when we started reading it
 	struct lunix_sensor_struct *sensor;
 	uint16_t raw_data;
-	uint32_t time;
+	uint64_t time;
+	unsigned long gen; //number of the update we are about to report
 	long measurement;
+	int len;
 	debug("entering update\n");
+	if (state->queue)
+		return lunix_chrdev_state_update_queue(state);
 	sensor = state->sensor;
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly, without taking any lock:
+	 * if the sensor was updated while we were copying, try again.
 	 */
 
     //retrieve raw data and update time
-	spin_lock_irqsave(&sensor->lock, flags);//In flags the flag goes register, no hard interrupts
-	/*Update buf_data by loading the data of 1 sensor*/
-	raw_data = sensor->msr_data[state->type]->values[0]; //save data and last update time
-	time = sensor->msr_data[state->type]->last_update; 
-	spin_unlock_irqrestore(&sensor->lock,flags);
+	do {
+		seq = read_seqbegin(&sensor->seqlock);
+		/*Update buf_data by loading the data of 1 sensor*/
+		raw_data = sensor->msr_data[state->type]->values[0]; //save data and last update time
+		time = sensor->msr_data[state->type]->timestamp; 
+		gen = sensor->generation;
+	} while (read_seqretry(&sensor->seqlock, seq));
 	
 	/*
 	 * Now we can take our time to format them,
 	 * holding only the private state semaphore
 	 */
 	
-	if(lunix_chrdev_state_needs_refresh(state)) //if data have been refreshed before last update then update timestamp, transform the value into the desired format
+	if(gen != state->buf_generation) //if the sensor has been updated since we last cached its data, transform the value into the desired format
     //and write into the buffer so we can read it when needed 
 	{
-		state -> buf_timestamp = time; //buf_timestamp is time of last update
-		switch (state->type) {
-			case BATT:
-				measurement = lookup_voltage[raw_data];
-				break;
-			case TEMP:
-				measurement = lookup_temperature[raw_data];
-				break;
-			case LIGHT:
-				measurement = lookup_light[raw_data];
-				break;
-			default:
-				return -EINVAL;
+		state->buf_generation = gen; //buf_generation is the update we have cached
+		if (!lunix_chrdev_rate_passes(state, gen, time))
+		{
+			debug("Rate limited, skipping\n");
+			return -EAGAIN;
 		}
-
-    		state->buf_lim = snprintf(state->buf_data, LUNIX_CHRDEV_BUFSZ, " %ld.%03ld\n", measurement / 1000, measurement % 1000);
+		//the latest value comes converted, and rendered as text, out of the sensor text cache
+		if (state->rate_flags & LUNIX_RATE_MEAN)
+			measurement = lunix_chrdev_mean(state, gen, raw_data);
+		else
+			measurement = lunix_chrdev_latest(state, raw_data, gen, &len);
+		if (!lunix_chrdev_deadband_passes(state, measurement))
+		{
+			debug("Within deadband, skipping\n");
+			return -EAGAIN;
+		}
+		if ((state->rate_flags & LUNIX_RATE_MEAN) || (state->mode & LUNIX_MODE_BINARY))
+			state->buf_lim = lunix_chrdev_format_value(state, state->buf_data, raw_data, measurement, time);
+		else
+			state->buf_lim = len;
+		state->last_value = measurement;
+		state->last_generation = gen;
+		state->last_timestamp = time;
+		state->delivered = 1;
 	}
 	else
 	{
@@ -117,6 +429,385 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	return 0;
 }
 
+/*
+ * Whether a read must fail with -EAGAIN rather than sleep,
+ * either for lack of data or on a contended state lock
+ */
+static int lunix_chrdev_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static int lunix_chrdev_lock(struct semaphore *lock, int nowait)
+{
+	if (nowait)
+		return down_trylock(lock) ? -EAGAIN : 0;
+	return down_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * A reader sleeping in lunix_chrdev_wait(). Its wake function runs
+ * in the context of the sensor update and only lets the wakeup through
+ * if the reader has something to report, so that readers held back
+ * by a deadband or a rate limit stay asleep.
+ */
+struct lunix_chrdev_waiter {
+	struct wait_queue_entry wq_entry;
+	struct lunix_chrdev_state_struct *state;
+};
+
+static int lunix_chrdev_wake_function(struct wait_queue_entry *wq_entry,
+                                      unsigned int mode, int sync, void *key)
+{
+	struct lunix_chrdev_waiter *w = container_of(wq_entry, struct lunix_chrdev_waiter, wq_entry);
+	int ret;
+
+	if (!lunix_chrdev_state_needs_refresh(w->state)) {
+		atomic64_inc(&w->state->filtered_wakeups);
+		lunix_stat_inc(LUNIX_STAT_WAKEUPS_FILTERED);
+		return 0;
+	}
+	ret = autoremove_wake_function(wq_entry, mode, sync, key);
+	if (ret) {
+		lunix_stat_inc(LUNIX_STAT_WAKEUPS);
+		trace_lunix_chrdev_wake(w->state->sensor->nodeid, w->state->type,
+		                        READ_ONCE(w->state->sensor->generation));
+	}
+	return ret;
+}
+
+/*
+ * Sleep until there is something to report to the reader,
+ * like wait_event_interruptible() with a filtering wake function.
+ * Called without the state lock held.
+ */
+static int lunix_chrdev_wait(struct lunix_chrdev_state_struct *state)
+{
+	wait_queue_head_t *wq = &state->sensor->wq[state->type];
+	struct lunix_chrdev_waiter w;
+	long ret = 0;
+
+	init_wait_entry(&w.wq_entry, 0);
+	w.wq_entry.func = lunix_chrdev_wake_function;
+	w.state = state;
+
+	for (;;) {
+		ret = prepare_to_wait_event(wq, &w.wq_entry, TASK_INTERRUPTIBLE);
+		if (lunix_chrdev_state_needs_refresh(state)) {
+			ret = 0;
+			break;
+		}
+		if (ret)
+			break;
+		schedule();
+	}
+	finish_wait(wq, &w.wq_entry);
+
+	return ret;
+}
+
+/*************************************
+ * Implementation of file operations
+ * for the aggregate /dev/lunix-all node
+ *************************************/
+
+static const char * const lunix_msr_names[N_LUNIX_MSR] = {
+	[BATT]  = "batt",
+	[TEMP]  = "temp",
+	[LIGHT] = "light"
+};
+
+static int lunix_chrdev_all_needs_refresh(struct lunix_chrdev_all_state_struct *state)
+{
+	return READ_ONCE(lunix_stream.head) != state->cursor;
+}
+
+/*
+ * Formats a batch of updates from the stream, one record per
+ * measurement. Must be called with the state lock held.
+ */
+static int lunix_chrdev_all_update(struct lunix_chrdev_all_state_struct *state)
+{
+	unsigned int seq;
+	unsigned long head, cursor, lost, n, i;
+	struct lunix_stream_entry *e;
+	long measurement;
+	u64 sec;
+	u32 nsec;
+	int type, lim, len;
+
+	do {
+		seq = read_seqbegin(&lunix_stream.seqlock);
+		head = lunix_stream.head;
+		cursor = state->cursor;
+		lost = 0;
+		if (head - cursor > LUNIX_STREAM_LEN) {
+			lost = head - cursor - LUNIX_STREAM_LEN;
+			cursor = head - LUNIX_STREAM_LEN;
+		}
+		n = min_t(unsigned long, head - cursor, LUNIX_CHRDEV_ALL_BATCH);
+		for (i = 0; i < n; i++)
+			state->entries[i] = lunix_stream.entries[(cursor + i) % LUNIX_STREAM_LEN];
+	} while (read_seqretry(&lunix_stream.seqlock, seq));
+
+	if (n == 0)
+		return -EAGAIN;
+	state->overruns += lost;
+	state->cursor = cursor + n;
+
+	lim = 0;
+	for (i = 0; i < n; i++) {
+		e = &state->entries[i];
+		for (type = 0; type < N_LUNIX_MSR; type++) {
+			measurement = lunix_chrdev_convert(type, e->values[type]);
+			if (state->mode & LUNIX_MODE_BINARY) {
+				struct lunix_all_record rec = {
+					.nodeid    = e->nodeid,
+					.type      = type,
+					.raw       = e->values[type],
+					.value     = measurement,
+					.timestamp = e->timestamp
+				};
+
+				memcpy(state->buf_data + lim, &rec, sizeof(rec));
+				lim += sizeof(rec);
+			} else {
+				/* "<nodeid> <name> <value> <seconds>.<nanoseconds>\n" */
+				lim += lunix_chrdev_put_udec(state->buf_data + lim, e->nodeid);
+				state->buf_data[lim++] = ' ';
+				len = strlen(lunix_msr_names[type]);
+				memcpy(state->buf_data + lim, lunix_msr_names[type], len);
+				lim += len;
+				state->buf_data[lim++] = ' ';
+				lim += lunix_chrdev_put_milli(state->buf_data + lim, measurement);
+				state->buf_data[lim++] = ' ';
+				sec = div_u64_rem(e->timestamp, NSEC_PER_SEC, &nsec);
+				lim += lunix_chrdev_put_udec(state->buf_data + lim, sec);
+				state->buf_data[lim++] = '.';
+				lim += lunix_chrdev_put_frac(state->buf_data + lim, nsec, 9);
+				state->buf_data[lim++] = '\n';
+			}
+		}
+	}
+	state->buf_lim = lim;
+
+	debug("batch of %lu updates, %d bytes\n", n, lim);
+	return 0;
+}
+
+static int lunix_chrdev_all_open(struct inode *inode, struct file *filp)
+{
+	int ret;
+	struct lunix_chrdev_all_state_struct *state;
+
+	if ((ret = nonseekable_open(inode, filp)) < 0)
+		return ret;
+
+	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+
+	/* Start off at the current end of the stream */
+	state->mode = LUNIX_MODE_TEXT | LUNIX_MODE_QUEUE;
+	state->cursor = READ_ONCE(lunix_stream.head);
+	state->overruns = 0;
+	state->buf_lim = 0;
+	state->buf_pos = 0;
+	sema_init(&state->lock, 1);
+
+	filp->private_data = state;
+	filp->f_mode |= FMODE_NOWAIT;
+	debug("opened /dev/lunix-all\n");
+	return 0;
+}
+
+static int lunix_chrdev_all_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+static long lunix_chrdev_all_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long ret;
+	int mode;
+	int __user *uarg = (int __user *)arg;
+	struct lunix_chrdev_stats stats;
+	struct lunix_chrdev_all_state_struct *state;
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	state = filp->private_data;
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	ret = 0;
+	switch (cmd) {
+	case LUNIX_IOC_SET_MODE:
+		if (get_user(mode, uarg)) {
+			ret = -EFAULT;
+			break;
+		}
+		/* This node always works in queue mode */
+		if (mode & ~(LUNIX_MODE_BINARY | LUNIX_MODE_QUEUE)) {
+			ret = -EINVAL;
+			break;
+		}
+		mode |= LUNIX_MODE_QUEUE;
+		if (mode != state->mode) {
+			state->mode = mode;
+			state->buf_lim = 0;
+			state->buf_pos = 0;
+		}
+		break;
+	case LUNIX_IOC_GET_MODE:
+		if (put_user(state->mode, uarg))
+			ret = -EFAULT;
+		break;
+	case LUNIX_IOC_GET_STATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.overruns = state->overruns;
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			ret = -EFAULT;
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+
+	up(&state->lock);
+	return ret;
+}
+
+static ssize_t lunix_chrdev_all_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	size_t cnt, copied;
+	int nowait, blocked;
+	struct lunix_chrdev_all_state_struct *state;
+
+	state = iocb->ki_filp->private_data;
+	nowait = lunix_chrdev_nowait(iocb);
+	if ((ret = lunix_chrdev_lock(&state->lock, nowait)) < 0)
+		return ret;
+
+	cnt = iov_iter_count(to);
+	if (state->mode & LUNIX_MODE_BINARY) {
+		cnt -= cnt % sizeof(struct lunix_all_record);
+		if (cnt == 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (state->buf_pos == 0) {
+		blocked = 0;
+		while (lunix_chrdev_all_update(state) == -EAGAIN) {
+			up(&state->lock);
+			if (nowait)
+				return -EAGAIN;
+			if (!blocked++)
+				lunix_stat_inc(LUNIX_STAT_READS_BLOCKED);
+			if (wait_event_interruptible(lunix_stream.wq, lunix_chrdev_all_needs_refresh(state)))
+				return -ERESTARTSYS;
+			if (down_interruptible(&state->lock))
+				return -ERESTARTSYS;
+		}
+	}
+
+	cnt = min(cnt, (size_t)(state->buf_lim - state->buf_pos));
+	copied = copy_to_iter(state->buf_data + state->buf_pos, cnt, to);
+	if (copied == 0 && cnt != 0) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ret = copied;
+	lunix_stat_inc(LUNIX_STAT_READS);
+
+	/* Rewind once the whole batch has been consumed */
+	if (state->buf_pos + copied == state->buf_lim)
+		state->buf_pos = 0;
+	else
+		state->buf_pos += copied;
+out:
+	up(&state->lock);
+	return ret;
+}
+
+static __poll_t lunix_chrdev_all_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_chrdev_all_state_struct *state = filp->private_data;
+
+	poll_wait(filp, &lunix_stream.wq, wait);
+	if (READ_ONCE(state->buf_pos) != 0 || lunix_chrdev_all_needs_refresh(state))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static struct file_operations lunix_chrdev_all_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = lunix_chrdev_all_open,
+	.release        = lunix_chrdev_all_release,
+	.read_iter      = lunix_chrdev_all_read_iter,
+	.unlocked_ioctl = lunix_chrdev_all_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.poll           = lunix_chrdev_all_poll
+};
+
+/*************************************
+ * Implementation of file operations
+ * for the /dev/lunix-status node
+ *************************************/
+
+/*
+ * Pages of the status area are only allocated as sensors show up,
+ * so they are mapped on first access rather than up front. Touching
+ * one past the last slot in use is a bug of the reader.
+ */
+static vm_fault_t lunix_chrdev_status_fault(struct vm_fault *vmf)
+{
+	unsigned long p;
+
+	p = lunix_status_page(vmf->pgoff);
+	if (!p)
+		return VM_FAULT_SIGBUS;
+
+	vmf->page = virt_to_page((void *)p);
+	get_page(vmf->page);
+	return 0;
+}
+
+static const struct vm_operations_struct lunix_chrdev_status_vm_ops = {
+	.fault = lunix_chrdev_status_fault
+};
+
+/*
+ * The status of all sensors can only be mapped, read-only,
+ * see struct lunix_status_struct
+ */
+static int lunix_chrdev_status_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff + vma_pages(vma) > lunix_status_size() >> PAGE_SHIFT)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &lunix_chrdev_status_vm_ops;
+	debug("mapping status, %lu bytes at offset %lu\n",
+	      vma->vm_end - vma->vm_start, vma->vm_pgoff << PAGE_SHIFT);
+	return 0;
+}
+
+static struct file_operations lunix_chrdev_status_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = nonseekable_open,
+	.mmap           = lunix_chrdev_status_mmap
+};
+
 /*************************************
  * Implementation of file operations
  * for the Lunix character device
@@ -128,10 +819,27 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	/* Declarations */
 	//lunix_chrdev_init();
 	struct lunix_chrdev_state_struct *state;
+	struct lunix_sensor_struct *sensor;
 	int ret;
 	unsigned int min_num, sensor_num;
 
 	debug("entering open\n");
+
+	/* Nodes past the last sensor cover the whole network */
+	if (iminor(inode) >= (lunix_sensor_cnt << 3)) {
+		switch (iminor(inode) - (lunix_sensor_cnt << 3)) {
+		case LUNIX_CHRDEV_ALL:
+			replace_fops(filp, fops_get(&lunix_chrdev_all_fops));
+			break;
+		case LUNIX_CHRDEV_STATUS:
+			replace_fops(filp, fops_get(&lunix_chrdev_status_fops));
+			break;
+		default:
+			return -ENODEV;
+		}
+		return filp->f_op->open(inode, filp);
+	}
+
 	ret = -ENODEV;
     //if open fails or inode/file distriptor are return
 	if ((ret = nonseekable_open(inode, filp)) < 0)
@@ -139,30 +847,58 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 		goto out;
 	}
 
-	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	/*
+	 * Associate this open file with the relevant sensor based on
+	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>].
+	 * Check it before allocating anything, most failed opens fail here.
+	 */
+	min_num = iminor(inode);
+	sensor_num = min_num >> 3; //take sensor num based on inode
+	if (sensor_num >= lunix_sensor_cnt || (min_num & 0x07) >= N_LUNIX_MSR)
+	{
+		debug("no sensor behind minor %u\n", min_num);
+		ret = -ENODEV;
+		goto out;
+	}
+	sensor = lunix_sensor_get(sensor_num + 1); //creates it if it has not shown up yet
+	if (!sensor)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	state = kmem_cache_alloc(lunix_chrdev_state_cache, GFP_KERNEL);
 	if (!state) 
 	{
     		debug("Memory allocation failed\n");
     		ret= -ENOMEM;
 		goto out;
 	}
-	/*
-	 * Associate this open file with the relevant sensor based on
-	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
-	 */
-	min_num = iminor(inode);
-	sensor_num = min_num >> 3; //take sensor num based on inode
-	state->sensor = &lunix_sensors[sensor_num]; //Sensor in state points to sensor state struct
+	state->sensor = sensor; //Sensor in state points to sensor state struct
 	min_num = min_num & 0x07; //keep last 3 bits to find the type
 	state->type = min_num;	
 	
-    state->buf_timestamp = 0;    // Indicates no data cached yet
+    state->mode = LUNIX_MODE_TEXT; // Text output unless asked otherwise
+    state->queue = NULL;         // Latest value only, unless asked otherwise
+    state->hist_cursor = 0;
+    state->overruns = 0;
+    state->spurious_wakeups = 0;
+    atomic64_set(&state->filtered_wakeups, 0);
+    state->buf_generation = 0;   // Indicates no data cached yet
+    state->deadband_mode = LUNIX_DEADBAND_OFF; // Every fresh measurement is news
+    state->deadband_width = 0;
+    state->rate_interval_ms = 0; // No rate limiting either
+    state->rate_decimation = 0;
+    state->rate_flags = 0;
+    state->delivered = 0;
     state->buf_lim = 0;         // Buffer size starts at zero
+    state->buf_pos = 0;         // Nothing of it read yet
     memset(&state->buf_data, 0, 20); // Clears the data buffer
     sema_init(&state->lock, 1); // Initializes the semaphore to 1 (unlocked state)
         
 	/* Allocate a new Lunix character device private state structure */
 	filp->private_data = state; //connect fd to struct
+	filp->f_mode |= FMODE_NOWAIT; //reads can honour IOCB_NOWAIT, e.g. from io_uring
 	ret = 0;
 out:
 	debug("leaving open, with ret = %d\n", ret);
@@ -172,19 +908,137 @@ out:
 //is called when a user space application (like cat) uses the close syscall 
 static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
-	kfree(filp->private_data); //free the memory of the pre-opened file 
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	kfree(state->queue);
+	kmem_cache_free(lunix_chrdev_state_cache, state); //free the memory of the pre-opened file 
 	return 0;
 }
 
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	return -EINVAL;
+	long ret;
+	int mode;
+	int __user *uarg = (int __user *)arg;
+	struct lunix_chrdev_stats stats;
+	struct lunix_deadband deadband;
+	struct lunix_rate rate;
+	struct lunix_chrdev_state_struct *state;
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	ret = 0;
+	switch (cmd) {
+	case LUNIX_IOC_SET_MODE:
+		if (get_user(mode, uarg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (mode & ~(LUNIX_MODE_BINARY | LUNIX_MODE_QUEUE)) {
+			ret = -EINVAL;
+			break;
+		}
+		/*
+		 * Entering queue mode starts the reader off at the
+		 * current end of the sensor history.
+		 */
+		if ((mode & LUNIX_MODE_QUEUE) && !state->queue) {
+			state->queue = kmalloc(sizeof(*state->queue), GFP_KERNEL);
+			if (!state->queue) {
+				ret = -ENOMEM;
+				break;
+			}
+			state->hist_cursor = READ_ONCE(state->sensor->generation);
+			state->overruns = 0;
+		}
+		if (!(mode & LUNIX_MODE_QUEUE) && state->queue) {
+			kfree(state->queue);
+			state->queue = NULL;
+		}
+		/*
+		 * Whatever is cached was formatted for the old mode,
+		 * so drop it. The next fresh measurement is reported
+		 * in the new format.
+		 */
+		if (mode != state->mode) {
+			state->mode = mode;
+			state->buf_lim = 0;
+			state->buf_pos = 0;
+		}
+		break;
+	case LUNIX_IOC_GET_MODE:
+		if (put_user(state->mode, uarg))
+			ret = -EFAULT;
+		break;
+	case LUNIX_IOC_GET_STATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.overruns = state->overruns;
+		stats.spurious_wakeups = state->spurious_wakeups;
+		stats.filtered_wakeups = atomic64_read(&state->filtered_wakeups);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			ret = -EFAULT;
+		break;
+	case LUNIX_IOC_SET_DEADBAND:
+		if (copy_from_user(&deadband, (void __user *)arg, sizeof(deadband))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (deadband.mode > LUNIX_DEADBAND_PCT || deadband.width > S32_MAX) {
+			ret = -EINVAL;
+			break;
+		}
+		state->deadband_mode = deadband.mode;
+		state->deadband_width = deadband.width;
+		break;
+	case LUNIX_IOC_GET_DEADBAND:
+		deadband.mode = state->deadband_mode;
+		deadband.width = state->deadband_width;
+		if (copy_to_user((void __user *)arg, &deadband, sizeof(deadband)))
+			ret = -EFAULT;
+		break;
+	case LUNIX_IOC_SET_RATE:
+		if (copy_from_user(&rate, (void __user *)arg, sizeof(rate))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (rate.flags & ~LUNIX_RATE_MEAN) {
+			ret = -EINVAL;
+			break;
+		}
+		state->rate_interval_ms = rate.interval_ms;
+		state->rate_decimation = rate.decimation;
+		state->rate_flags = rate.flags;
+		break;
+	case LUNIX_IOC_GET_RATE:
+		memset(&rate, 0, sizeof(rate));
+		rate.interval_ms = state->rate_interval_ms;
+		rate.decimation = state->rate_decimation;
+		rate.flags = state->rate_flags;
+		if (copy_to_user((void __user *)arg, &rate, sizeof(rate)))
+			ret = -EFAULT;
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+
+	up(&state->lock);
+	debug("cmd 0x%x, ret = %ld\n", cmd, ret);
+	return ret;
 }
 
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t ret;
-	
+	size_t cnt, copied;
+	int nowait, woken;
+	struct file *filp = iocb->ki_filp;
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
    	debug("entering read\n");
@@ -194,65 +1048,139 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
-    //acquire semaphore and if interrupted try again
-	if(down_interruptible(&state->lock))
-	{
-		ret = -EAGAIN;
-		goto out;
+	/* Neither O_NONBLOCK readers nor io_uring's IOCB_NOWAIT ones may sleep */
+	nowait = lunix_chrdev_nowait(iocb);
+
+    //acquire semaphore and if interrupted let the syscall be restarted
+	if ((ret = lunix_chrdev_lock(&state->lock, nowait)) < 0)
+		goto out_unlocked;
+
+	/* Binary records are never split across reads */
+	cnt = iov_iter_count(to);
+	if (state->mode & LUNIX_MODE_BINARY) {
+		cnt -= cnt % sizeof(struct lunix_msr_record);
+		if (cnt == 0) {
+			ret = -EINVAL;
+			goto out;
+		}
 	}
+
 	/*
 	 * If the cached character device state needs to be
 	 * updated by actual sensor data (i.e. we need to report
 	 * on a "fresh" measurement, do so
 	 */
-	if(*f_pos == 0) {
+	if(state->buf_pos == 0) {
+		woken = 0;
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
+            /* Woken up for nothing, e.g. another reader of this fd got there first */
+            if (woken)
+                state->spurious_wakeups++;
+
             /* Release lock while sleeping */
             up(&state->lock);
 
-            
+            /* Non-blocking readers must not sleep waiting for data */
+            if (nowait) {
+                ret = -EAGAIN;
+                goto out_unlocked;
+            }
+            if (!woken)
+                lunix_stat_inc(LUNIX_STAT_READS_BLOCKED);
+
             /* Wait for sensor data to become available */
-            if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state))) //Non-Blocking op
-                return -ERESTARTSYS;
+            if (lunix_chrdev_wait(state)) {
+                ret = -ERESTARTSYS;
+                goto out_unlocked;
+            }
+            woken = 1;
 
             /* Reacquire the lock */
-            if (down_interruptible(&state->lock))
-                return -ERESTARTSYS;
+            if (down_interruptible(&state->lock)) {
+                ret = -ERESTARTSYS;
+                goto out_unlocked;
+            }
         }
 
 	}
 	
-	cnt = min(cnt,(size_t)(state->buf_lim - *f_pos));
+	cnt = min(cnt,(size_t)(state->buf_lim - state->buf_pos));
 	
-	/* End of file */
-	ret = cnt; // - *f_pos;
-
-	if(copy_to_user(usrbuf,state->buf_data + *f_pos,cnt))
+	copied = copy_to_iter(lunix_chrdev_state_buf(state) + state->buf_pos, cnt, to);
+	if (copied == 0 && cnt != 0)
 	{
 		ret = -EFAULT;
 		goto out;
 	}
+	ret = copied;
+	lunix_stat_inc(LUNIX_STAT_READS);
+
 	/* Auto-rewind on EOF mode? */
-	if(cnt == state->buf_lim)
+	if(state->buf_pos + copied == state->buf_lim)
 	{
-		*f_pos = 0;
+		state->buf_pos = 0;
 		goto out;
 	}
 	else
 	{       	
-		*f_pos = *f_pos + cnt;
+		state->buf_pos = state->buf_pos + copied;
 	}
 
 out:
 	up(&state->lock);
 	//wake_up_interruptible(&sensor->wq);
-	debug("%d out with bytes %li in read\n", state->type, (long)cnt);
+out_unlocked:
+	trace_lunix_chrdev_read(sensor->nodeid, state->type, ret);
+	debug("%d out with bytes %li in read\n", state->type, (long)ret);
 	return ret;
 }
 
+/*
+ * Report the node as readable whenever a read would not block:
+ * either a fresh measurement is waiting, or the reader is in the
+ * middle of consuming the previous one.
+ */
+static __poll_t lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	__poll_t mask;
+	struct lunix_chrdev_state_struct *state;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	poll_wait(filp, &state->sensor->wq[state->type], wait);
+
+	mask = 0;
+	if (READ_ONCE(state->buf_pos) != 0 || lunix_chrdev_state_needs_refresh(state))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+/*
+ * Map the measurement page of this node read-only into userspace.
+ * Readers then use the sequence counter inside the page to get
+ * consistent snapshots without entering the kernel at all.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state;
+	unsigned long pfn;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	pfn = virt_to_phys(state->sensor->msr_data[state->type]) >> PAGE_SHIFT;
+	debug("mapping msr page of type %d at pfn 0x%lx\n", state->type, pfn);
+	return remap_pfn_range(vma, vma->vm_start, pfn, PAGE_SIZE, vma->vm_page_prot);
 }
 
 //tells the kernel how to handle system calls (ex. open calls lunix_chrdev_open)
@@ -261,24 +1189,77 @@ static struct file_operations lunix_chrdev_fops =
 	.owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
-	.read           = lunix_chrdev_read,
+	.read_iter      = lunix_chrdev_read_iter,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.poll           = lunix_chrdev_poll,
 	.mmap           = lunix_chrdev_mmap
 };
 
+/*
+ * Device nodes are world-readable, as they used to be when made by mknod
+ */
+static char *lunix_chrdev_devnode(const struct device *dev, umode_t *mode)
+{
+	if (mode)
+		*mode = 0644;
+	return NULL;
+}
+
+/*
+ * Creates the device nodes of a sensor that just showed up,
+ * /dev/lunix<sensor>-<measurement>, where sensor is its node id minus one.
+ * Failing to do so is not fatal, the nodes can still be made by hand.
+ */
+void lunix_chrdev_sensor_add(struct lunix_sensor_struct *s)
+{
+	int type;
+	struct device *dev;
+
+	for (type = 0; type < N_LUNIX_MSR; type++) {
+		dev = device_create(lunix_chrdev_class, NULL,
+		                    MKDEV(LUNIX_CHRDEV_MAJOR, ((s->nodeid - 1) << 3) + type), NULL,
+		                    "lunix%u-%s", s->nodeid - 1, lunix_msr_names[type]);
+		if (IS_ERR(dev))
+			printk(KERN_WARNING "Failed to create device node for sensor %u, ret = %ld\n",
+			       s->nodeid - 1, PTR_ERR(dev));
+	}
+}
+
 //this function is called when calling the command insmod ~/path/to/lunix.ko
 int lunix_chrdev_init(void)
 {
 	/*
 	 * Register the character device with the kernel, asking for
-	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * a range of minor numbers (number of sensors * 8 measurements / sensor,
+	 * plus the nodes covering all sensors) beginning with LINUX_CHRDEV_MAJOR:0
 	 */ 
 	int ret;
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	struct device *dev;
+	unsigned int lunix_minor_cnt = (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_NR_CTL;
+
+	BUILD_BUG_ON(sizeof(struct lunix_msr_record) > LUNIX_CHRDEV_BUFSZ);
+	BUILD_BUG_ON(LUNIX_MSR_TEXT_LEN > LUNIX_CHRDEV_BUFSZ);
 
 	debug("initializing character device\n");
+	lunix_chrdev_state_cache = kmem_cache_create("lunix_chrdev_state",
+	                                             sizeof(struct lunix_chrdev_state_struct), 0,
+	                                             SLAB_HWCACHE_ALIGN | SLAB_NO_MERGE, NULL);
+	if (!lunix_chrdev_state_cache) {
+		debug("failed to create state cache\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	lunix_chrdev_class = class_create("lunix");
+	if (IS_ERR(lunix_chrdev_class)) {
+		debug("failed to create device class\n");
+		ret = PTR_ERR(lunix_chrdev_class);
+		goto out_with_cache;
+	}
+	lunix_chrdev_class->devnode = lunix_chrdev_devnode;
+
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
 	lunix_chrdev_cdev.owner = THIS_MODULE;
 	
@@ -288,7 +1269,7 @@ int lunix_chrdev_init(void)
 	ret = register_chrdev_region(dev_no, lunix_minor_cnt, "lunix");
 	if (ret < 0) {
 		debug("failed to register region, ret = %d\n", ret);
-		goto out;
+		goto out_with_class;
 	}
 	
 	/* cdev_add. Adding char device to kernel*/
@@ -297,11 +1278,37 @@ int lunix_chrdev_init(void)
 		debug("failed to add character device\n");
 		goto out_with_chrdev_region;
 	}
+
+	/* The nodes covering all sensors are there from the start */
+	dev = device_create(lunix_chrdev_class, NULL,
+	                    MKDEV(LUNIX_CHRDEV_MAJOR, (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_ALL),
+	                    NULL, "lunix-all");
+	if (IS_ERR(dev)) {
+		debug("failed to create /dev/lunix-all\n");
+		ret = PTR_ERR(dev);
+		goto out_with_cdev;
+	}
+	dev = device_create(lunix_chrdev_class, NULL,
+	                    MKDEV(LUNIX_CHRDEV_MAJOR, (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_STATUS),
+	                    NULL, "lunix-status");
+	if (IS_ERR(dev)) {
+		debug("failed to create /dev/lunix-status\n");
+		ret = PTR_ERR(dev);
+		goto out_with_all;
+	}
 	debug("completed successfully\n");
 	return 0;
 
+out_with_all:
+	device_destroy(lunix_chrdev_class, MKDEV(LUNIX_CHRDEV_MAJOR, (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_ALL));
+out_with_cdev:
+	cdev_del(&lunix_chrdev_cdev);
 out_with_chrdev_region:
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
+out_with_class:
+	class_destroy(lunix_chrdev_class);
+out_with_cache:
+	kmem_cache_destroy(lunix_chrdev_state_cache);
 out:
 	return ret;
 }
@@ -310,13 +1317,26 @@ out:
 void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	int type;
+	unsigned long nodeid;
+	struct lunix_sensor_struct *s;
+	unsigned int lunix_minor_cnt = (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_NR_CTL;
 
 	debug("entering destroy\n");
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0); //initialize device
+
+	/* Remove the device nodes of every sensor that showed up, then the class */
+	xa_for_each(&lunix_sensors, nodeid, s)
+		for (type = 0; type < N_LUNIX_MSR; type++)
+			device_destroy(lunix_chrdev_class, dev_no + ((nodeid - 1) << 3) + type);
+	device_destroy(lunix_chrdev_class, dev_no + (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_ALL);
+	device_destroy(lunix_chrdev_class, dev_no + (lunix_sensor_cnt << 3) + LUNIX_CHRDEV_STATUS);
+	class_destroy(lunix_chrdev_class);
+
 	cdev_del(&lunix_chrdev_cdev); //removes the character device
 	unregister_chrdev_region(dev_no, lunix_minor_cnt); // Frees the 
     //region of device numbers allocated to the driver during initialization (lunix_chrdev_init) 
     //prevents the system from reserving these device numbers for this driver, making them available for other drivers.
+	kmem_cache_destroy(lunix_chrdev_state_cache);
 	debug("leaving destroy\n");
 }
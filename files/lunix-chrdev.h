@@ -16,16 +16,40 @@
 #define LUNIX_CHRDEV_MAJOR 60   /* Reserved for local / experimental use */
 #define LUNIX_CHRDEV_BUFSZ 20   /* Buffer size used to hold textual info */
 
+/*
+ * Minor numbers sensor << 3 | type belong to the per-sensor nodes,
+ * where sensor is the node id minus one. The ones right past them,
+ * starting at lunix_sensor_cnt << 3, belong to nodes covering
+ * the whole sensor network.
+ */
+#define LUNIX_CHRDEV_ALL    0   /* /dev/lunix-all, every update of every sensor */
+#define LUNIX_CHRDEV_STATUS 1   /* /dev/lunix-status, mappable status of all sensors,
+                                   raw values, see struct lunix_status_struct */
+#define LUNIX_CHRDEV_NR_CTL 2
+
+#define LUNIX_CHRDEV_ALL_BATCH 64  /* Max sensor updates returned by one read */
+#define LUNIX_CHRDEV_ALL_RECSZ 48  /* Room for one record, text or binary */
+
 /* Compile-time parameters */
 
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
+#include <linux/atomic.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
 #include "lunix.h"
 
+/*
+ * Buffers of a reader in queue mode: a batch of samples copied
+ * out of the sensor history, and the same batch once formatted
+ */
+struct lunix_chrdev_queue_struct {
+	struct lunix_sample samples[LUNIX_SENSOR_HIST];
+	unsigned char data[LUNIX_SENSOR_HIST * LUNIX_CHRDEV_BUFSZ];
+};
+
 /*
  * Private state for an open character device node
  */
@@ -33,34 +57,192 @@ struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
 	struct lunix_sensor_struct *sensor;
 
-	/* A buffer used to hold cached textual info */
+	/* Output format and delivery, a combination of LUNIX_MODE_* */
+	int mode;
+
+	/*
+	 * A buffer used to hold cached textual info, and how much of it
+	 * has been read so far. The read offset lives here, under the
+	 * lock, rather than in the file position, which nothing
+	 * serializes against the ioctls that drop the buffer.
+	 */
 	int buf_lim;
+	int buf_pos;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	unsigned long buf_generation;
+
+	/*
+	 * Deadband filtering, latest-value mode only: a fresh measurement
+	 * is reported only if it differs from last_value, the last one
+	 * reported, by more than the width of the deadband.
+	 */
+	int deadband_mode;
+	uint32_t deadband_width;
+
+	/*
+	 * Rate limiting, latest-value mode only: report at most one
+	 * measurement per interval, and/or one per rate_decimation
+	 * updates, optionally the mean of all updates since the last
+	 * one reported.
+	 */
+	uint32_t rate_interval_ms;
+	uint32_t rate_decimation;
+	uint32_t rate_flags;
+
+	/* The last measurement reported, if delivered is set */
+	long last_value;
+	unsigned long last_generation;
+	uint64_t last_timestamp;
+	int delivered;
+
+	/*
+	 * Queue mode: the next update of the sensor history to be
+	 * reported, the number of samples lost because this reader
+	 * fell too far behind, and the buffers batches are built in.
+	 * queue is NULL unless LUNIX_MODE_QUEUE is set.
+	 */
+	unsigned long hist_cursor;
+	uint64_t overruns;
+	struct lunix_chrdev_queue_struct *queue;
+
+	/*
+	 * Blocking reads woken up only to find nothing to report, and
+	 * wakeups held back by lunix_chrdev_wake_function() because there
+	 * was nothing to report. The latter is bumped in the context of
+	 * the sensor update, without the lock.
+	 */
+	uint64_t spurious_wakeups;
+	atomic64_t filtered_wakeups;
 
 	struct semaphore lock;
 
 	/*
-	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
+	 * Blocking vs. non-blocking mode is taken from
+	 * the O_NONBLOCK flag of the open file itself.
 	 */
 };
 
+/*
+ * Private state for an open /dev/lunix-all node. Every read
+ * returns a batch of whatever has been appended to the stream
+ * of sensor updates since the previous one.
+ */
+struct lunix_chrdev_all_state_struct {
+	int mode;
+
+	unsigned long cursor;
+	uint64_t overruns;
+
+	/* The batch being read, and how much of it has been read so far */
+	int buf_lim;
+	int buf_pos;
+	struct lunix_stream_entry entries[LUNIX_CHRDEV_ALL_BATCH];
+	unsigned char buf_data[LUNIX_CHRDEV_ALL_BATCH * N_LUNIX_MSR * LUNIX_CHRDEV_ALL_RECSZ];
+
+	struct semaphore lock;
+};
+
 /*
  * Function prototypes
  */
 int lunix_chrdev_init(void);
 void lunix_chrdev_destroy(void);
+void lunix_chrdev_sensor_add(struct lunix_sensor_struct *);
 
+#else
+#include <inttypes.h>
 #endif /* __KERNEL__ */
 
 #include <linux/ioctl.h>
 
+/*
+ * Read modes of a character device node
+ */
+#define LUNIX_MODE_TEXT     0   /* Human-readable text, e.g. " 23.456\n" */
+#define LUNIX_MODE_BINARY   1   /* One struct lunix_msr_record per measurement */
+#define LUNIX_MODE_QUEUE    2   /* Flag: report every sample since the last read,
+                                   not just the latest one */
+
+/*
+ * Fixed-size record returned by read() in LUNIX_MODE_BINARY
+ */
+struct lunix_msr_record {
+	uint32_t raw;        /* Raw 16-bit value, as received from the sensor */
+	int32_t value;       /* Converted value, in milli-units */
+	uint64_t timestamp;  /* Time the update was received, CLOCK_MONOTONIC ns */
+};
+
+/*
+ * Record returned by read() on /dev/lunix-all in LUNIX_MODE_BINARY,
+ * one per measurement of every sensor update. In LUNIX_MODE_TEXT,
+ * each is a line "<nodeid> <name> <value> <timestamp>\n" instead,
+ * with the timestamp in seconds, e.g. "3 temp 23.456 5234.000123456\n".
+ */
+struct lunix_all_record {
+	uint16_t nodeid;     /* XMesh node id of the sensor, starting from 1 */
+	uint16_t type;       /* 0: battery, 1: temperature, 2: light */
+	uint32_t raw;        /* Raw 16-bit value, as received from the sensor */
+	int32_t value;       /* Converted value, in milli-units */
+	uint32_t reserved;
+	uint64_t timestamp;  /* Time the update was received, CLOCK_MONOTONIC ns */
+};
+
+/*
+ * Deadband of a reader, set with LUNIX_IOC_SET_DEADBAND. Fresh measurements
+ * within the deadband of the last one reported are skipped, without making
+ * the node readable. Does not apply in queue mode.
+ */
+#define LUNIX_DEADBAND_OFF  0
+#define LUNIX_DEADBAND_ABS  1   /* width in milli-units */
+#define LUNIX_DEADBAND_PCT  2   /* width in thousandths of a percent
+                                   of the last value reported */
+
+struct lunix_deadband {
+	uint32_t mode;
+	uint32_t width;
+};
+
+/*
+ * Rate limit of a reader, set with LUNIX_IOC_SET_RATE. A fresh measurement
+ * is only reported once interval_ms have passed and decimation updates have
+ * been applied since the last one reported. Zero disables either limit.
+ * Does not apply in queue mode.
+ */
+#define LUNIX_RATE_MEAN     1   /* Report the mean of the skipped measurements,
+                                   rather than the latest one */
+
+struct lunix_rate {
+	uint32_t interval_ms;
+	uint32_t decimation;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/*
+ * Per-open statistics, returned by LUNIX_IOC_GET_STATS
+ */
+struct lunix_chrdev_stats {
+	uint64_t overruns;   /* Samples [updates, on /dev/lunix-all] lost
+	                        in queue mode by falling behind */
+	uint64_t spurious_wakeups;  /* Blocking reads woken up with nothing
+	                               to report, always 0 on /dev/lunix-all */
+	uint64_t filtered_wakeups;  /* Sensor updates that did not wake up a
+	                               blocking read, since it would have had
+	                               nothing to report; 0 on /dev/lunix-all */
+};
+
 /*
  * Definition of ioctl commands
  */
 #define LUNIX_IOC_MAGIC     LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE _IOR(LUNIX_IOC_MAGIC, 0, void *)
-
-#define LUNIX_IOC_MAXNR 0
+#define LUNIX_IOC_SET_MODE  _IOW(LUNIX_IOC_MAGIC, 0, int)
+#define LUNIX_IOC_GET_MODE  _IOR(LUNIX_IOC_MAGIC, 1, int)
+#define LUNIX_IOC_GET_STATS _IOR(LUNIX_IOC_MAGIC, 2, struct lunix_chrdev_stats)
+#define LUNIX_IOC_SET_DEADBAND _IOW(LUNIX_IOC_MAGIC, 3, struct lunix_deadband)
+#define LUNIX_IOC_GET_DEADBAND _IOR(LUNIX_IOC_MAGIC, 4, struct lunix_deadband)
+#define LUNIX_IOC_SET_RATE  _IOW(LUNIX_IOC_MAGIC, 5, struct lunix_rate)
+#define LUNIX_IOC_GET_RATE  _IOR(LUNIX_IOC_MAGIC, 6, struct lunix_rate)
+
+#define LUNIX_IOC_MAXNR 6
 
 #endif /* _LUNIX_H */
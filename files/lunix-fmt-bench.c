@@ -0,0 +1,92 @@
+/*
+ * lunix-fmt-bench.c
+ *
+ * Times the text formatting of measurements done on every refresh
+ * of a Lunix:TNG node, lunix_chrdev_format_text(), against the
+ * snprintf(" %ld.%03ld\n") it replaced, and checks that both
+ * produce the same bytes.
+ *
+ * usage: lunix-fmt-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lunix-format.h"
+
+#define NVALUES 4096
+
+static long values[NVALUES];
+static volatile int sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int format_snprintf(unsigned char *buf, long measurement)
+{
+	return snprintf((char *)buf, 20, " %ld.%03ld\n",
+	                measurement / 1000, measurement % 1000);
+}
+
+static double bench(int (*format)(unsigned char *, long), long iters)
+{
+	unsigned char buf[20];
+	double start;
+	long i;
+
+	start = now();
+	for (i = 0; i < iters; i++)
+		sink += format(buf, values[i % NVALUES]);
+	return (now() - start) * 1e9 / iters;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char a[20], b[20];
+	long iters = argc > 1 ? atol(argv[1]) : 20000000;
+	double t_snprintf, t_lunix;
+	int i, la, lb;
+
+	if (iters <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	/*
+	 * The range of the lookup tables: temperatures around -40..+80
+	 * degrees, light up to a few thousand, battery a few volts.
+	 */
+	srand(1);
+	for (i = 0; i < NVALUES; i++)
+		values[i] = rand() % 5000000 - 40000;
+
+	/*
+	 * The old format prints "-1.-500" for -1500, so compare on the
+	 * values where it was right.
+	 */
+	for (i = 0; i < NVALUES; i++) {
+		if (values[i] < 0)
+			continue;
+		la = format_snprintf(a, values[i]);
+		lb = lunix_chrdev_format_text(b, values[i]);
+		if (la != lb || memcmp(a, b, la)) {
+			fprintf(stderr, "mismatch for %ld: \"%.*s\" vs \"%.*s\"\n",
+			        values[i], la, a, lb, b);
+			return 1;
+		}
+	}
+
+	t_snprintf = bench(format_snprintf, iters);
+	t_lunix = bench(lunix_chrdev_format_text, iters);
+	printf("snprintf:                 %6.1f ns/call\n", t_snprintf);
+	printf("lunix_chrdev_format_text: %6.1f ns/call (%.1fx)\n",
+	       t_lunix, t_snprintf / t_lunix);
+	return 0;
+}
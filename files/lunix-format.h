@@ -0,0 +1,90 @@
+/*
+ * lunix-format.h
+ *
+ * Text formatting of measurements for the
+ * Lunix:TNG character device, kept free of
+ * snprintf so that it can also be built and
+ * timed in userspace (see lunix-fmt-bench.c).
+ */
+
+#ifndef _LUNIX_FORMAT_H
+#define _LUNIX_FORMAT_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+/*
+ * Writes the decimal digits of n to buf, returns their number.
+ */
+static inline int lunix_chrdev_put_udec(unsigned char *buf, uint32_t n)
+{
+	unsigned char tmp[10];
+	int i = sizeof(tmp), len;
+
+	do {
+		tmp[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	len = sizeof(tmp) - i;
+	memcpy(buf, tmp + i, len);
+	return len;
+}
+
+/*
+ * Writes the low width decimal digits of n to buf, zero-padded,
+ * for the fractional part of a fixed-point number. Returns width.
+ */
+static inline int lunix_chrdev_put_frac(unsigned char *buf, uint32_t n, int width)
+{
+	int i;
+
+	for (i = width - 1; i >= 0; i--) {
+		buf[i] = '0' + n % 10;
+		n /= 10;
+	}
+	return width;
+}
+
+/*
+ * Writes a milli-unit measurement to buf as a decimal number with
+ * exactly three fractional digits, e.g. "-1.500" for -1500. This is
+ * on the path of every refresh, so avoid snprintf; measurements
+ * always fit in the 32-bit value of struct lunix_msr_record.
+ * Returns the number of bytes written, at most 12.
+ */
+static inline int lunix_chrdev_put_milli(unsigned char *buf, int32_t measurement)
+{
+	uint32_t n = measurement;
+	int len = 0;
+
+	if (measurement < 0) {
+		buf[len++] = '-';
+		n = -n;
+	}
+
+	len += lunix_chrdev_put_udec(buf + len, n / 1000);
+	buf[len++] = '.';
+	len += lunix_chrdev_put_frac(buf + len, n % 1000, 3);
+	return len;
+}
+
+/*
+ * The text record of a per-sensor node, " <value>\n".
+ */
+static inline int lunix_chrdev_format_text(unsigned char *buf, long measurement)
+{
+	int len = 0;
+
+	buf[len++] = ' ';
+	len += lunix_chrdev_put_milli(buf + len, measurement);
+	buf[len++] = '\n';
+	return len;
+}
+
+#endif /* _LUNIX_FORMAT_H */
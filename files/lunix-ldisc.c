@@ -10,11 +10,13 @@
 #include <linux/tty.h>
 #include <linux/slab.h>
 #include <linux/init.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
 #include <linux/serio.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
 
-#include <asm/atomic.h>
 #include <asm/uaccess.h>
 
 #include "lunix.h"
@@ -22,25 +24,147 @@
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * Incoming bytes are not parsed in the context of the TTY layer.
+ * lunix_ldisc_receive_buf2() just copies them to a ring, which a worker
+ * drains in large batches, feeding the protocol state machine. There
+ * is a single producer and a single consumer per TTY, so the ring is
+ * a lock-free kfifo.
+ *
+ * Every call of lunix_ldisc_receive_buf2() also puts a record of the
+ * chunk it received, its length and timestamp, in a second kfifo, so
+ * that each packet can be stamped with the time its last byte came in.
+ *
+ * Flow control works the way n_tty does it: once the ring, or the
+ * chunk records, are more than 3/4 full, the port is throttled, and
+ * the worker unthrottles it once they are down to 1/4. Should the ring
+ * fill up nevertheless, lunix_ldisc_receive_buf2() takes in only what
+ * fits and the TTY layer keeps the rest queued in its flip buffers,
+ * until the port receives more data and pushes it to us again.
  */
-static atomic_t lunix_disc_available;
+#define LUNIX_LDISC_RING_LEN  65536   /* Must be a power of 2 */
+#define LUNIX_LDISC_CHUNKS    512     /* Chunk records, a power of 2 too */
+#define LUNIX_LDISC_BATCH     4096    /* Bytes parsed in one go */
+#define LUNIX_LDISC_BATCH_CHUNKS 64   /* and at most as many chunks */
+
+struct lunix_ldisc_chunk {
+	unsigned int len;
+	uint64_t timestamp;     /* Time it was received at [CLOCK_MONOTONIC, in ns] */
+};
+
+struct lunix_ldisc_struct {
+	struct tty_struct *tty;
+	struct kfifo ring;
+	DECLARE_KFIFO(chunks, struct lunix_ldisc_chunk, LUNIX_LDISC_CHUNKS);
+	struct work_struct work;
+
+	unsigned long ring_full;       /* Times the ring or the chunk records were full */
+	unsigned long throttled;       /* Times the port was throttled */
+
+	/* Worker only */
+	struct lunix_protocol_state_struct protocol;
+	unsigned char batch[LUNIX_LDISC_BATCH];
+	struct lunix_protocol_chunk batch_chunks[LUNIX_LDISC_BATCH_CHUNKS];
+};
+
+static struct workqueue_struct *lunix_ldisc_wq;
+
+static bool lunix_ldisc_above_high(struct lunix_ldisc_struct *ld)
+{
+	return kfifo_len(&ld->ring) > LUNIX_LDISC_RING_LEN / 4 * 3 ||
+	       kfifo_len(&ld->chunks) > LUNIX_LDISC_CHUNKS / 4 * 3;
+}
+
+static bool lunix_ldisc_below_low(struct lunix_ldisc_struct *ld)
+{
+	return kfifo_len(&ld->ring) < LUNIX_LDISC_RING_LEN / 4 &&
+	       kfifo_len(&ld->chunks) < LUNIX_LDISC_CHUNKS / 4;
+}
+
+/*
+ * Asks the port to stop sending, the way tty_throttle_safe() does for
+ * n_tty; that one is internal to the TTY core. tty_unthrottle() undoes it.
+ */
+static void lunix_ldisc_throttle(struct lunix_ldisc_struct *ld)
+{
+	struct tty_struct *tty = ld->tty;
+
+	down_write(&tty->termios_rwsem);
+	if (!test_and_set_bit(TTY_THROTTLED, &tty->flags)) {
+		debug("throttling TTY %s\n", tty->name);
+		ld->throttled++;
+		if (tty->ops->throttle)
+			tty->ops->throttle(tty);
+	}
+	up_write(&tty->termios_rwsem);
+}
+
+/*
+ * The worker: feeds whatever has been received to the protocol
+ * state machine, a batch of whole chunks at a time, and lets the
+ * port send again once the ring is mostly empty.
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	struct lunix_ldisc_struct *ld = container_of(work, struct lunix_ldisc_struct, work);
+	struct lunix_ldisc_chunk chunk;
+	unsigned int len, n;
+
+	do {
+		len = n = 0;
+		while (n < LUNIX_LDISC_BATCH_CHUNKS && !kfifo_is_empty(&ld->chunks)) {
+			/*
+			 * A chunk is recorded after its bytes have been put in
+			 * the ring; pairs with the barrier in kfifo_put().
+			 */
+			smp_rmb();
+			kfifo_peek(&ld->chunks, &chunk);
+			if (len + chunk.len > LUNIX_LDISC_BATCH)
+				break;
+			kfifo_get(&ld->chunks, &chunk);
+			len += kfifo_out(&ld->ring, ld->batch + len, chunk.len);
+			ld->batch_chunks[n].end = len;
+			ld->batch_chunks[n].timestamp = chunk.timestamp;
+			n++;
+		}
+		if (n)
+			lunix_protocol_received_buf(&ld->protocol, ld->batch, len,
+			                            ld->batch_chunks, n);
+
+		if (tty_throttled(ld->tty) && lunix_ldisc_below_low(ld)) {
+			debug("room in the ring again, unthrottling TTY %s\n", ld->tty->name);
+			tty_unthrottle(ld->tty);
+		}
+	} while (n);
+}
 
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
+ *
+ * Any number of TTYs, i.e. base stations, may use it at the same time.
+ * Each gets a ring, a worker and a protocol state machine of its own,
+ * in tty->disc_data, while they all feed the same sensors.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	int ret;
+	struct lunix_ldisc_struct *ld;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	/* Can only be associated with a single TTY */
-	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
-		return -EBUSY;
-
-	tty->receive_room = 65536; /* No flow control, FIXME */
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		return -ENOMEM;
+	if ((ret = kfifo_alloc(&ld->ring, LUNIX_LDISC_RING_LEN, GFP_KERNEL)) < 0) {
+		kfree(ld);
+		return ret;
+	}
+	INIT_KFIFO(ld->chunks);
+	ld->tty = tty;
+	INIT_WORK(&ld->work, lunix_ldisc_work);
+	lunix_protocol_init(&ld->protocol);
+	tty->disc_data = ld;
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
@@ -52,35 +176,77 @@ static int lunix_ldisc_open(struct tty_struct *tty)
  */
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
-	atomic_inc(&lunix_disc_available);
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+	struct lunix_protocol_state_struct *state = &ld->protocol;
+
+	cancel_work_sync(&ld->work);
+
+	if (state->crc_errors || state->resyncs || ld->ring_full || ld->throttled)
+		printk(KERN_INFO "Lunix:TNG: TTY %s: dropped %lu packets with a bad CRC, "
+		       "%lu with broken framing, skipped %lu bytes, ring full %lu times, "
+		       "throttled %lu times\n",
+		       tty->name, state->crc_errors, state->resyncs, state->bytes_skipped,
+		       ld->ring_full, ld->throttled);
+	kfifo_free(&ld->ring);
+	kfree(ld);
+	tty->disc_data = NULL;
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
 	debug("lunix ldisc being closed\n");
 }
 
 /*
- * lunix_ldisc_receive_buf() is called by the TTY layer when data have been
+ * lunix_ldisc_receive_buf2() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
- * will not be re-entered while running.
+ * will not be re-entered while running. Returns the number of bytes taken,
+ * the TTY layer keeps the rest for later.
  */
-static void lunix_ldisc_receive_buf(struct tty_struct *tty,
-                                    const unsigned char *cp,
-                                    const unsigned char *fp, size_t count)
+static size_t lunix_ldisc_receive_buf2(struct tty_struct *tty,
+                                       const unsigned char *cp,
+                                       const unsigned char *fp, size_t count)
 {
-#if LUNIX_DEBUG
-	int i;
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+	struct lunix_ldisc_chunk chunk;
+	size_t n, i;
+
+	/*
+	 * Timestamp the data as early as possible.
+	 */
+	chunk.timestamp = ktime_get_ns();
 
-	debug("called, %lu characters have been received. Data at *cp: { ", count);
-	for (i = 0; i < count; i++)
-		printk(KERN_CONT "0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
-	printk(KERN_CONT " }\n");
-#endif
+	if (lunix_debugging()) {
+		debug("called, %lu characters have been received. Data at *cp: { ", count);
+		for (i = 0; i < count; i++)
+			printk(KERN_CONT "0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
+		printk(KERN_CONT " }\n");
+	}
 
 	/*
-	 * Pass incoming characters to protocol processing code,
-	 * which handles any necessary sensor updates.
+	 * Pass incoming characters on to the worker, which hands
+	 * them to the protocol processing code. They are recorded in
+	 * chunks no larger than its batch, each after its bytes.
 	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	for (n = 0; n < count; n += chunk.len) {
+		if (kfifo_is_full(&ld->chunks))
+			break;
+		chunk.len = kfifo_in(&ld->ring, cp + n,
+		                     min_t(size_t, count - n, LUNIX_LDISC_BATCH));
+		if (!chunk.len)
+			break;
+		kfifo_put(&ld->chunks, chunk);
+	}
+	if (n < count) {
+		ld->ring_full++;
+		debug("ring full, took %lu of %lu bytes\n", n, count);
+	}
+
+	lunix_stat_add(LUNIX_STAT_BYTES, n);
+
+	if (!tty_throttled(tty) && lunix_ldisc_above_high(ld))
+		lunix_ldisc_throttle(ld);
+	queue_work(lunix_ldisc_wq, &ld->work);
+
+	return n;
 }
 
 /*
@@ -114,7 +280,7 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close       = lunix_ldisc_close,
 	.read        = lunix_ldisc_read,
 	.write       = lunix_ldisc_write,
-	.receive_buf = lunix_ldisc_receive_buf
+	.receive_buf2 = lunix_ldisc_receive_buf2
 };
 
 int lunix_ldisc_init(void)
@@ -122,11 +288,18 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
+	lunix_ldisc_wq = alloc_workqueue("lunix", WQ_HIGHPRI, 0);
+	if (!lunix_ldisc_wq) {
+		printk(KERN_ERR "%s: Error allocating workqueue.\n", __FILE__);
+		return -ENOMEM;
+	}
+
 	ret = tty_register_ldisc(&lunix_ldisc_ops);
-	if (ret)
+	if (ret) {
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n",
 		                __FILE__, ret);
+		destroy_workqueue(lunix_ldisc_wq);
+	}
 
 	debug("leaving with ret = %d\n", ret);
 	return ret;
@@ -136,5 +309,6 @@ void lunix_ldisc_destroy(void)
 {
 	debug("unregistering lunix ldisc\n");
 	tty_unregister_ldisc(&lunix_ldisc_ops);
+	destroy_workqueue(lunix_ldisc_wq);
 	debug("lunix ldisc unregistered\n");
 }
@@ -10,6 +10,8 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/xarray.h>
+#include <linux/jump_label.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
@@ -20,8 +22,36 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+DEFINE_XARRAY(lunix_sensors);
+struct lunix_stream_struct lunix_stream;
+struct lunix_status_struct *lunix_status;
+bool lunix_crc_check = true;
+
+/*
+ * Debugging output, see debug(). Builds with LUNIX_DEBUG
+ * set start with it on, it can be toggled either way through
+ * /sys/module/lunix/parameters/lunix_debug.
+ */
+DEFINE_STATIC_KEY_FALSE(lunix_debug_key);
+static bool lunix_debug = LUNIX_DEBUG;
+
+static int lunix_debug_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	if ((ret = param_set_bool(val, kp)) < 0)
+		return ret;
+	if (lunix_debug)
+		static_branch_enable(&lunix_debug_key);
+	else
+		static_branch_disable(&lunix_debug_key);
+	return 0;
+}
+
+static const struct kernel_param_ops lunix_debug_ops = {
+	.set = lunix_debug_set,
+	.get = param_get_bool
+};
 
 /*
  * Module init and cleanup functions
@@ -30,59 +60,60 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 static int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
+
+	/* Unless lunix_debug was given at load time, which did it already */
+	if (lunix_debug)
+		static_branch_enable(&lunix_debug_key);
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+	ret = -EINVAL;
+	if (lunix_sensor_cnt < 1 || lunix_sensor_cnt > LUNIX_SENSOR_MAX) {
+		printk(KERN_ERR "lunix_sensor_cnt must be between 1 and %d\n",
+		       LUNIX_SENSOR_MAX);
 		goto out;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
 
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * Sensors themselves are created as they show up,
+	 * see lunix_sensor_get().
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
+	lunix_stream_init(&lunix_stream);
+	lunix_protocol_crc_init();
+	if ((ret = lunix_status_init()) < 0) {
+		printk(KERN_ERR "Failed to allocate the Lunix status page\n");
+		goto out;
 	}
 
 	/*
-	 * Initialize the Lunix line discipline
+	 * Initialize the Lunix character device, before anything
+	 * can arrive through the line discipline and create a sensor
+	 * that needs device nodes.
 	 */
-	if ((ret = lunix_ldisc_init()) < 0)
-		goto out_with_sensors;
+	if ((ret = lunix_chrdev_init()) < 0)
+		goto out_with_status;
 
 	/*
-	 * Initialize the Lunix character device
+	 * Initialize the Lunix line discipline
 	 */
-	if ((ret = lunix_chrdev_init()) < 0)
-		goto out_with_ldisc;
+	if ((ret = lunix_ldisc_init()) < 0)
+		goto out_with_chrdev;
 
+	lunix_stats_init();
 	return 0;
 
 	/*
 	 * Something's gone wrong, undo everything
 	 * we've done up to this point
 	 */
-out_with_ldisc:
-	debug("at out_with_ldisc\n");
-	lunix_ldisc_destroy();
+out_with_chrdev:
+	debug("at out_with_chrdev\n");
+	lunix_chrdev_destroy();
 
-out_with_sensors:
-	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+out_with_status:
+	debug("at out_with_status\n");
+	lunix_status_destroy();
 
 out:
 	debug("at out\n");
@@ -91,16 +122,14 @@ out:
 
 static void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
-	debug("entering, destroying chrdev and ldisc\n");
-	lunix_chrdev_destroy();
+	debug("entering, destroying stats, ldisc and chrdev\n");
+	lunix_stats_destroy();
 	lunix_ldisc_destroy();
-	
+	lunix_chrdev_destroy();
+
 	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
+	lunix_status_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -114,7 +143,11 @@ MODULE_AUTHOR("Vangelis Koukis");
 MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
-MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support, i.e. the largest node id");
+module_param(lunix_crc_check, bool, 0644);
+MODULE_PARM_DESC(lunix_crc_check, "Drop packets with a bad CRC [default: yes]");
+module_param_cb(lunix_debug, &lunix_debug_ops, &lunix_debug, 0644);
+MODULE_PARM_DESC(lunix_debug, "Print debugging messages [default: no, unless built with DEBUG=y]");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
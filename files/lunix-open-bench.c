@@ -0,0 +1,59 @@
+/*
+ * lunix-open-bench.c
+ *
+ * Opens and closes a Lunix:TNG node in a loop, to time the
+ * allocation and release of the per-open state of the driver.
+ *
+ * usage: lunix-open-bench [node] [seconds]
+ *
+ * e.g. lunix-open-bench /dev/lunix0-temp 5
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const char *node = argc > 1 ? argv[1] : "/dev/lunix0-temp";
+	double seconds = argc > 2 ? atof(argv[2]) : 5;
+	double start, elapsed;
+	unsigned long opens;
+	int fd, i;
+
+	if (seconds <= 0) {
+		fprintf(stderr, "usage: %s [node] [seconds]\n", argv[0]);
+		exit(1);
+	}
+
+	start = now();
+	opens = 0;
+	do {
+		/* Check the clock every 1024 opens, not on each one */
+		for (i = 0; i < 1024; i++) {
+			fd = open(node, O_RDONLY);
+			if (fd < 0) {
+				perror(node);
+				exit(1);
+			}
+			close(fd);
+		}
+		opens += i;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+
+	printf("%s: %lu opens in %.2f s, %.0f opens/s, %.0f ns per open/close\n",
+	       node, opens, elapsed, opens / elapsed, elapsed * 1e9 / opens);
+	return 0;
+}
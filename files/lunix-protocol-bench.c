@@ -0,0 +1,330 @@
+/*
+ * lunix-protocol-bench.c
+ *
+ * Runs the XMesh parser of Lunix:TNG, lunix_protocol_received_buf(),
+ * in userspace over a synthetic stream of sensor packets, and reports
+ * its throughput. The parser is built right into this file, with the
+ * kernel API it needs coming from lunix-shim.h; build another version
+ * of it to compare with make PROTOCOL_SRC=<path/to/lunix-protocol.c>.
+ *
+ * usage: lunix-protocol-bench [megabytes] [chunk size]
+ *
+ * Two streams are timed, one with random payloads, where about one
+ * byte in a hundred needs escaping, and one where every byte does.
+ * Both are fed to the parser chunk size bytes at a time, the way a
+ * TTY driver hands over what the serial port received. The best of
+ * TRIALS runs is reported, to leave out noise from the rest of the system.
+ *
+ * Then one packet in GLITCH_EVERY of the random stream gets a bit
+ * flipped, a byte inserted or a byte deleted, and the packets lost
+ * for each such glitch are reported. Only the glitched packet itself
+ * has to be; anything more is the parser losing track of the framing.
+ *
+ * Last, it checks that every packet gets the timestamp of the chunk
+ * it ends in, with several chunks passed in each call, as the line
+ * discipline does.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef LUNIX_PROTOCOL_SRC
+#define LUNIX_PROTOCOL_SRC "lunix-protocol.c"
+#endif
+#include LUNIX_PROTOCOL_SRC
+
+#define NPACKETS   16384
+#define PAYLOAD    29
+#define STREAM_LEN (NPACKETS * 2 * (PAYLOAD + 10))
+#define TRIALS     5
+
+#define GLITCH_EVERY 50
+
+/*
+ * What the parser calls into: a few sensors, counting their updates
+ */
+int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+bool lunix_crc_check = true;
+struct lunix_stream_struct lunix_stream;
+
+static struct lunix_sensor_struct sensors[LUNIX_SENSOR_CNT];
+static unsigned long updates;
+
+/* Times each packet was received, by the sequence number it carries */
+static unsigned int *seen;
+
+/* Timestamp of each packet received, by the sequence number it carries */
+static uint64_t *stamps;
+
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid)
+{
+	return &sensors[nodeid - 1];
+}
+
+void lunix_sensor_update(struct lunix_sensor_struct *s,
+                         uint16_t batt, uint16_t temp, uint16_t light,
+                         uint64_t timestamp)
+{
+	updates++;
+	if (seen && batt < NPACKETS)
+		seen[batt]++;
+	if (stamps && batt < NPACKETS)
+		stamps[batt] = timestamp;
+}
+
+void lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+}
+
+void lunix_stream_wake(struct lunix_stream_struct *st)
+{
+}
+
+/*
+ * CRC-16-CCITT, initial value 0, of the packet type up to the payload
+ */
+static uint16_t crc16(const unsigned char *p, int n)
+{
+	uint16_t crc = 0;
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		crc ^= p[i] << 8;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static int put_escaped(unsigned char *out, unsigned char c)
+{
+	if (c == 0x7E || c == 0x7D) {
+		out[0] = 0x7D;
+		out[1] = c ^ 0x20;
+		return 2;
+	}
+	out[0] = c;
+	return 1;
+}
+
+/*
+ * Writes a sensor packet from node nodeid to out, byte-stuffed as on
+ * the wire, with seq in place of the battery measurement. If stuffed,
+ * every payload byte but the node id and seq needs escaping.
+ * Returns its length.
+ */
+static int make_packet(unsigned char *out, uint16_t nodeid, uint16_t seq,
+                       int stuffed)
+{
+	unsigned char raw[6 + PAYLOAD];
+	uint16_t crc;
+	int i, len;
+
+	raw[0] = 0x42;                  /* Packet type */
+	raw[1] = raw[2] = 0xFF;         /* Destination: broadcast */
+	raw[3] = 0x0B;                  /* AM type: sensor data */
+	raw[4] = 0x7D;                  /* AM group */
+	raw[5] = PAYLOAD;
+	for (i = 0; i < PAYLOAD; i++)
+		raw[6 + i] = stuffed ? 0x7D + (rand() & 1) : rand();
+	raw[NODE_OFFSET - 1] = nodeid & 0xFF;
+	raw[NODE_OFFSET] = nodeid >> 8;
+	raw[VREF_OFFSET - 1] = seq & 0xFF;
+	raw[VREF_OFFSET] = seq >> 8;
+	crc = crc16(raw, sizeof(raw));
+
+	len = 0;
+	out[len++] = 0x7E;
+	out[len++] = raw[0];
+	for (i = 1; i < sizeof(raw); i++)
+		len += put_escaped(out + len, raw[i]);
+	len += put_escaped(out + len, crc & 0xFF);
+	len += put_escaped(out + len, crc >> 8);
+	out[len++] = 0x7E;
+	return len;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *name, int stuffed, double megabytes, int chunk_size)
+{
+	static unsigned char stream[STREAM_LEN];
+	struct lunix_protocol_state_struct state;
+	struct lunix_protocol_chunk chunk = { 0, 0 };
+	unsigned long rounds, r;
+	double start, elapsed, best;
+	int i, n, len, t;
+
+	for (i = 0; i < LUNIX_SENSOR_CNT; i++) {
+		sensors[i].flags = 0;
+		INIT_LIST_HEAD(&sensors[i].dirty);
+	}
+
+	len = 0;
+	for (i = 0; i < NPACKETS; i++)
+		len += make_packet(stream + len, 1 + i % LUNIX_SENSOR_CNT, i, stuffed);
+	rounds = megabytes * 1e6 / len + 1;
+
+	best = 0;
+	for (t = 0; t < TRIALS; t++) {
+		lunix_protocol_init(&state);
+		updates = 0;
+		start = now();
+		for (r = 0; r < rounds; r++)
+			for (i = 0; i < len; i += n) {
+				n = min(chunk_size, len - i);
+				chunk.end = n;
+				lunix_protocol_received_buf(&state, stream + i, n, &chunk, 1);
+			}
+		elapsed = now() - start;
+
+		if (updates != rounds * NPACKETS) {
+			fprintf(stderr, "%s: %lu packets parsed out of %lu\n",
+			        name, updates, rounds * NPACKETS);
+			return -1;
+		}
+		if (t == 0 || elapsed < best)
+			best = elapsed;
+	}
+	printf("%-8s %5.1f bytes/packet %8.1f MB/s %6.2f ns/byte\n", name,
+	       (double)len / NPACKETS, rounds * len / best / 1e6,
+	       best * 1e9 / (rounds * len));
+	return 0;
+}
+
+enum glitch { BITFLIP, INSERT, DELETE };
+
+/*
+ * Feeds the parser a stream of random packets, with a glitch in every
+ * GLITCH_EVERY-th, and reports how many packets and bytes were lost.
+ */
+static void glitch(const char *name, enum glitch type, int chunk_size)
+{
+	static unsigned char stream[STREAM_LEN];
+	static unsigned int counts[NPACKETS];
+	unsigned char packet[2 * (PAYLOAD + 10)];
+	struct lunix_protocol_state_struct state;
+	struct lunix_protocol_chunk chunk = { 0, 0 };
+	int i, n, at, len, plen, glitches, lost, lost_bytes;
+
+	len = glitches = 0;
+	for (i = 0; i < NPACKETS; i++) {
+		plen = make_packet(packet, 1 + i % LUNIX_SENSOR_CNT, i, 0);
+		memcpy(stream + len, packet, plen);
+		if (i % GLITCH_EVERY == GLITCH_EVERY / 2) {
+			at = rand() % plen;
+			switch (type) {
+			case BITFLIP:
+				stream[len + at] ^= 1 << (rand() % 8);
+				break;
+			case INSERT:
+				memmove(stream + len + at + 1, stream + len + at, plen - at);
+				stream[len + at] = rand();
+				plen++;
+				break;
+			case DELETE:
+				memmove(stream + len + at, stream + len + at + 1, plen - at - 1);
+				plen--;
+				break;
+			}
+			glitches++;
+		}
+		len += plen;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	seen = counts;
+	lunix_protocol_init(&state);
+	for (i = 0; i < len; i += n) {
+		n = min(chunk_size, len - i);
+		chunk.end = n;
+		lunix_protocol_received_buf(&state, stream + i, n, &chunk, 1);
+	}
+	seen = NULL;
+
+	lost = lost_bytes = 0;
+	for (i = 0; i < NPACKETS; i++)
+		if (!counts[i]) {
+			lost++;
+			lost_bytes += make_packet(packet, 1 + i % LUNIX_SENSOR_CNT, i, 0);
+		}
+	printf("%-8s %5d glitches %6.2f packets %7.1f bytes lost per glitch\n",
+	       name, glitches, (double)lost / glitches, (double)lost_bytes / glitches);
+}
+
+/*
+ * Feeds the parser a stream of random packets, CHUNKS chunks at a
+ * time, each stamped with its number, and checks the stamps packets get.
+ */
+#define CHUNKS 8
+
+static int check_stamps(int chunk_size)
+{
+	static unsigned char stream[STREAM_LEN];
+	static uint64_t packet_stamps[NPACKETS];
+	static int ends[NPACKETS];
+	struct lunix_protocol_state_struct state;
+	struct lunix_protocol_chunk chunks[CHUNKS];
+	int i, n, c, len, wrong;
+
+	len = 0;
+	for (i = 0; i < NPACKETS; i++) {
+		len += make_packet(stream + len, 1 + i % LUNIX_SENSOR_CNT, i, 0);
+		ends[i] = len;
+	}
+
+	stamps = packet_stamps;
+	lunix_protocol_init(&state);
+	for (i = 0; i < len; i += n) {
+		n = 0;
+		for (c = 0; c < CHUNKS && i + n < len; c++) {
+			n += min(chunk_size, len - i - n);
+			chunks[c].end = n;
+			chunks[c].timestamp = (i + n - 1) / chunk_size;
+		}
+		lunix_protocol_received_buf(&state, stream + i, n, chunks, c);
+	}
+	stamps = NULL;
+
+	wrong = 0;
+	for (i = 0; i < NPACKETS; i++)
+		if (packet_stamps[i] != (ends[i] - 1) / chunk_size)
+			wrong++;
+	if (wrong) {
+		fprintf(stderr, "%d packets out of %d got the wrong timestamp\n",
+		        wrong, NPACKETS);
+		return -1;
+	}
+	printf("timestamps of %d packets in %d byte chunks ok\n", NPACKETS, chunk_size);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	double megabytes = argc > 1 ? atof(argv[1]) : 100;
+	int chunk_size = argc > 2 ? atoi(argv[2]) : 64;
+
+	if (megabytes <= 0 || chunk_size <= 0) {
+		fprintf(stderr, "usage: %s [megabytes] [chunk size]\n", argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	lunix_protocol_crc_init();
+	printf("%s, %d byte chunks\n", LUNIX_PROTOCOL_SRC, chunk_size);
+	if (bench("random", 0, megabytes, chunk_size) < 0 ||
+	    bench("stuffed", 1, megabytes, chunk_size) < 0)
+		return 1;
+	glitch("bitflip", BITFLIP, chunk_size);
+	glitch("insert", INSERT, chunk_size);
+	glitch("delete", DELETE, chunk_size);
+	if (check_stamps(chunk_size) < 0)
+		return 1;
+	return 0;
+}
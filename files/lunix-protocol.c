@@ -14,10 +14,14 @@
  *
  */
 
+#include <linux/list.h>
+#include <linux/cache.h>
+#include <linux/bitops.h>
 #include <linux/kernel.h>
 #include <asm/byteorder.h>
 
 #include "lunix.h"
+#include "lunix-trace.h"
 #include "lunix-protocol.h"
 
 /*
@@ -39,15 +43,48 @@ static uint16_t uint16_from_packet(unsigned char *p)
 static inline void lunix_protocol_show_packet(
     struct lunix_protocol_state_struct *state)
 {
-#if LUNIX_DEBUG
 	int ctr;
 
+	if (!lunix_debugging())
+		return;
+
 	debug("Current packet: called, pos = %d, Packet data: { ", state->pos);
 	for (ctr = 0; ctr < state->pos; ctr++)
 		printk(KERN_CONT "0x%02x%s",
 		       state->packet[ctr], (ctr == state->pos - 1) ? "" : ", ");
 	printk(KERN_CONT " }\n");
-#endif
+}
+
+/*
+ * Queues an updated sensor to be woken up at the end of the batch,
+ * unless it already is, by this or any other protocol state.
+ */
+static void lunix_protocol_mark_dirty(struct lunix_protocol_state_struct *state,
+                                      struct lunix_sensor_struct *s)
+{
+	if (!test_and_set_bit(LUNIX_SENSOR_DIRTY, &s->flags))
+		list_add_tail(&s->dirty, &state->dirty);
+}
+
+/*
+ * Wakes up the readers of every sensor updated during the batch,
+ * and of the stream of all updates, once each. The bit is cleared
+ * with a fully ordered atomic before waking up, so that updates by
+ * anyone who found it still set are visible to the readers woken.
+ */
+static void lunix_protocol_wake_dirty(struct lunix_protocol_state_struct *state)
+{
+	struct lunix_sensor_struct *s, *tmp;
+
+	if (list_empty(&state->dirty))
+		return;
+
+	list_for_each_entry_safe(s, tmp, &state->dirty, dirty) {
+		list_del_init(&s->dirty);
+		test_and_clear_bit(LUNIX_SENSOR_DIRTY, &s->flags);
+		lunix_sensor_wake(s);
+	}
+	lunix_stream_wake(&lunix_stream);
 }
 
 /*
@@ -58,14 +95,16 @@ static inline void lunix_protocol_show_packet(
  */
 static void lunix_protocol_update_sensors(
          struct lunix_protocol_state_struct *state,
-         struct lunix_sensor_struct *lunix_sensors)
+         uint64_t timestamp)
 {
+	struct lunix_sensor_struct *s;
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
 	uint16_t nodeid;
 
-	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
+	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET] &&
+	    state->payload_length >= LIGHT_OFFSET + 2 - PAYLOAD_OFFSET)
 	{
 		nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
 		batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
@@ -77,14 +116,78 @@ static void lunix_protocol_update_sensors(
 		       "{ batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
 		       nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
+		if (nodeid > 0 && nodeid <= lunix_sensor_cnt) {
+			if (!(s = lunix_sensor_get(nodeid))) {
+				lunix_stat_inc(LUNIX_STAT_NODES_DROPPED);
+				return;
+			}
+			lunix_sensor_update(s, batt, temp, light, timestamp);
+			lunix_protocol_mark_dirty(state, s);
+		} else {
+			lunix_stat_inc(LUNIX_STAT_NODES_DROPPED);
 			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
 			                    nodeid, lunix_sensor_cnt);
+		}
 	}
 }
 
+/*
+ * CRC of XMesh packets: CRC-16-CCITT [polynomial 0x1021, MSB first,
+ * initial value 0], over everything from the packet type to the end of
+ * the payload, unescaped, stored little-endian right after the payload.
+ *
+ * It is computed two bytes at a time (slicing-by-2): lunix_crc_table[0]
+ * is the usual table for one byte, lunix_crc_table[1] the one for a byte
+ * followed by a zero byte, so that the two lookups are independent.
+ */
+static uint16_t lunix_crc_table[2][256] __read_mostly;
+
+void lunix_protocol_crc_init(void)
+{
+	int i, bit;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		lunix_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		lunix_crc_table[1][i] = (uint16_t)(lunix_crc_table[0][i] << 8) ^
+		                        lunix_crc_table[0][lunix_crc_table[0][i] >> 8];
+}
+
+static uint16_t lunix_protocol_crc16(uint16_t crc, const unsigned char *p, int n)
+{
+	for (; n >= 2; n -= 2, p += 2)
+		crc = lunix_crc_table[1][(crc >> 8) ^ p[0]] ^
+		      lunix_crc_table[0][(crc & 0xFF) ^ p[1]];
+	if (n)
+		crc = (uint16_t)(crc << 8) ^ lunix_crc_table[0][(crc >> 8) ^ p[0]];
+	return crc;
+}
+
+/*
+ * Adds the next n bytes of the packet, just unescaped into
+ * state->packet[state->pos], to its CRC, if they are covered by it
+ */
+static inline void lunix_protocol_crc_add(struct lunix_protocol_state_struct *state, int n)
+{
+	if (state->state >= SEEKING_PACKET_TYPE && state->state <= SEEKING_PAYLOAD)
+		state->crc = lunix_protocol_crc16(state->crc, &state->packet[state->pos], n);
+}
+
+/*
+ * Whether the CRC of a complete packet, end byte included, is right
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	if (!lunix_crc_check)
+		return 1;
+	return state->crc == uint16_from_packet(&state->packet[state->pos - 3]);
+}
+
 /******************************************************************************
  *                     ----- PACKET STRUCTURE -----
  ******************************************************************************
@@ -111,14 +214,101 @@ static inline void set_state(struct lunix_protocol_state_struct *statep,
 	statep->bytes_read = br;
 }
 
+/*
+ * Drops the packet being received, after a framing error, and goes
+ * looking for the next one. If it was a start byte that showed the
+ * framing to be broken, the next packet starts right there.
+ */
+static void lunix_protocol_resync(struct lunix_protocol_state_struct *state,
+                                  int at_start_byte)
+{
+	debug("Framing error at pos = %d, resyncing\n", state->pos);
+	lunix_protocol_show_packet(state);
+	state->resyncs++;
+	lunix_stat_inc(LUNIX_STAT_PACKETS_DROPPED);
+	state->next_is_special = 0;
+	if (at_start_byte) {
+		state->packet[0] = 0x7E;
+		state->pos = 1;
+		state->crc = 0;
+		set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+	} else {
+		state->pos = 0;
+		set_state(state, SEEKING_START_BYTE, 1, 0);
+	}
+}
+
+/*
+ * Skips everything up to the next start byte. Returns 1
+ * if it was found, and the next packet starts there.
+ */
+static int lunix_protocol_seek_start(struct lunix_protocol_state_struct *state,
+                                     const unsigned char *data, int length, int *i)
+{
+	const unsigned char *p;
+	int skipped;
+
+	p = memchr(&data[*i], 0x7E, length - *i);
+	skipped = (p ? p - data : length) - *i;
+	state->bytes_skipped += skipped;
+	*i += skipped;
+	if (!p)
+		return 0;
+
+	state->packet[0] = 0x7E;
+	state->pos = 1;
+	++(*i);
+	return 1;
+}
+
 /*
  * Initialization of protocol state machine
  */
 void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 {
+	/* Header, payload, CRC and end byte */
+	BUILD_BUG_ON(PAYLOAD_OFFSET + MAX_PAYLOAD_LEN + 3 > MAX_PACKET_LEN);
+	BUILD_BUG_ON(LIGHT_OFFSET + 2 - PAYLOAD_OFFSET > MAX_PAYLOAD_LEN);
+
 	state->pos = 0;
 	state->next_is_special = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
+	INIT_LIST_HEAD(&state->dirty);
+	state->crc = 0;
+	state->crc_errors = 0;
+	state->resyncs = 0;
+	state->bytes_skipped = 0;
+}
+
+/*
+ * Whether a word holds a zero byte, without false positives.
+ * The byte flagged may not be the first zero one, though.
+ */
+static inline unsigned long lunix_protocol_has_zero(unsigned long w)
+{
+	return (w - REPEAT_BYTE(0x01)) & ~w & REPEAT_BYTE(0x80);
+}
+
+/*
+ * Returns the length of the run of ordinary bytes, i.e. neither 0x7E
+ * nor 0x7D, at the start of data[0..n). Scans a word at a time, then
+ * byte by byte from the word the first special byte is in.
+ */
+static int lunix_protocol_plain_run(const unsigned char *data, int n)
+{
+	int i;
+	unsigned long w;
+
+	for (i = 0; i + (int)sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, &data[i], sizeof(w));
+		if (lunix_protocol_has_zero(w ^ REPEAT_BYTE(0x7E)) |
+		    lunix_protocol_has_zero(w ^ REPEAT_BYTE(0x7D)))
+			break;
+	}
+	for (; i < n; i++)
+		if ((0x7E == data[i]) || (0x7D == data[i]))
+			break;
+	return i;
 }
 
 /*
@@ -131,64 +321,88 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
  * int *i: the pointer to the data received is updated when data are 
  *         transferred to the unparsed_packet array
  * int use_specials: if 1 special characters are treated acc
+ *
+ * Returns 1 once the state has all the bytes it wants, 0 if it needs
+ * more data, -1 if the packet had to be dropped, see lunix_protocol_resync().
  */
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
                                       const unsigned char *data, int length,
                                       int *i, int use_specials)
 {
-	int iter;
+	int run;
 
-	iter = 0;
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
-#if LUNIX_DEBUG
-		if (++iter == 50) {
-			debug("OOPS!\n");
-			return -1;
-		}
-#endif
-		/* Prevent buffer overflows */
+		/*
+		 * Prevent buffer overflows. Payloads are at most MAX_PAYLOAD_LEN
+		 * bytes long, so a packet never comes near MAX_PACKET_LEN; this
+		 * only guards against a bug in the state machine itself.
+		 */
 		if (state->pos == MAX_PACKET_LEN) {
 			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
 			       "packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+			lunix_protocol_resync(state, 0);
 			return -1;
 		}
 
-		if (1 == use_specials)
+		/*
+		 * Byte-stuffed data never hold a start byte, one
+		 * can only mean that a new packet begins there
+		 */
+		if (1 == use_specials && 0x7E == data[*i])
 		{
-			if (state->next_is_special)
-			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
+			++(*i);
+			lunix_protocol_resync(state, 1);
+			return -1;
+		}
+
+		if (1 == use_specials && state->next_is_special)
+		{
+			state->packet[state->pos] = data[*i]^0x20;
+			lunix_protocol_crc_add(state, 1);
+			++state->pos;
+			++state->bytes_read;
+			++(*i);
+			state->next_is_special = 0;
+		}
+		else if (1 == use_specials && 0x7D == data[*i])
+		{
+			/*
+			 * Unescape the pair in one go, unless the data received
+			 * end right after its first byte, or the second one is a
+			 * start byte, to be dealt with above
+			 */
+			if (*i + 1 < length && 0x7E != data[*i + 1]) {
+				state->packet[state->pos] = data[*i + 1]^0x20;
+				lunix_protocol_crc_add(state, 1);
 				++state->pos;
 				++state->bytes_read;
+				*i += 2;
+			} else {
+				state->next_is_special = data[*i];
 				++(*i);
-				state->next_is_special = 0;
-			}
-			else
-			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
-				{
-					state->next_is_special = data[*i];
-					++(*i);
-				} else {
-					state->packet[state->pos] = data[*i];
-					++state->pos;
-					++state->bytes_read;
-					++(*i);
-				}
 			}
 		}
 		else
 		{
-			state->packet[state->pos] = data[*i];
-			++state->pos;
-			++state->bytes_read;
-			++(*i);
+			/*
+			 * Copy the whole run of ordinary bytes this one starts
+			 * in one go, as far as the data received, this state and
+			 * the packet buffer allow. Between escapes, runs are often
+			 * a single byte, not worth a call to memcpy.
+			 */
+			run = min3(length - *i, state->bytes_to_read - state->bytes_read,
+			           MAX_PACKET_LEN - state->pos);
+			if (1 == use_specials)
+				run = 1 + lunix_protocol_plain_run(&data[*i + 1], run - 1);
+			if (1 == run)
+				state->packet[state->pos] = data[*i];
+			else
+				memcpy(&state->packet[state->pos], &data[*i], run);
+			lunix_protocol_crc_add(state, run);
+			state->pos += run;
+			state->bytes_read += run;
+			*i += run;
 		}
 	}
 
@@ -201,60 +415,108 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 
 /*
  * This function gets called for incoming data
- * to update the protocol state machine.
+ * to update the protocol state machine. The data are made of nchunks
+ * chunks, the last one ending at length, each received at a time of
+ * its own. A packet is stamped with the time of the chunk it ends in,
+ * when it was complete.
+ *
+ * The data may hold any number of packets, readers of the sensors
+ * they update are only woken up once all of them have been applied.
  */
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
-                                const unsigned char *buf, int length)
+                                const unsigned char *buf, int length,
+                                const struct lunix_protocol_chunk *chunks, int nchunks)
 {
-	int i;
+	int i, c;
+	int crc_ok;
 	int payload_length;
 
 	i = 0;
+	c = 0;
 
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+	while (i < length) {
+		if (state->state == SEEKING_START_BYTE) 
+			if (lunix_protocol_seek_start(state, buf, length, &i) == 1) {
+				state->crc = 0;
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+			}
 
 
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+		/*
+		 * Two start bytes in a row: the first one was really
+		 * the end byte of a packet we were not in sync with.
+		 */
+		if (state->state == SEEKING_PACKET_TYPE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				if (0x7E == state->packet[state->pos - 1]) {
+					state->pos = 1;
+					state->crc = 0;
+					set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+				} else
+					set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+			}
 
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
+		if (state->state == SEEKING_DESTINATION_ADDRESS) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_TYPE, 1, 0);
 
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
+		if (state->state == SEEKING_AM_TYPE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_GROUP, 1, 0);
 
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+		if (state->state == SEEKING_AM_GROUP) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
 
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
-		}
+		if (state->state == SEEKING_PAYLOAD_LENGTH) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
+				payload_length = state->packet[state->pos - 1];
+				if (payload_length > MAX_PAYLOAD_LEN)
+					lunix_protocol_resync(state, 0);
+				else {
+					state->payload_length = payload_length;
+					set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+				}
+			}
 
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
+		if (state->state == SEEKING_PAYLOAD) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_CRC, 2, 0);
 
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
+		if (state->state == SEEKING_CRC) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_END_BYTE, 1, 0);
 
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			debug("A complete XMesh packet has been received, updating sensors\n");
+		if (state->state == SEEKING_END_BYTE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				if (0x7E != state->packet[state->pos - 1]) {
+					lunix_protocol_resync(state, 0);
+					continue;
+				}
+				crc_ok = lunix_protocol_crc_ok(state);
+				trace_lunix_packet(state->packet[PACKET_SIGNATURE_OFFSET],
+				                   state->payload_length, crc_ok);
+				if (crc_ok) {
+					lunix_stat_inc(LUNIX_STAT_PACKETS);
+					lunix_stat_packet_type(state->packet[PACKET_SIGNATURE_OFFSET]);
+					debug("A complete XMesh packet has been received, updating sensors\n");
+					while (c < nchunks - 1 && chunks[c].end < i)
+						c++;
+					lunix_protocol_update_sensors(state, chunks[c].timestamp);
+				} else {
+					state->crc_errors++;
+					lunix_stat_inc(LUNIX_STAT_PACKETS_DROPPED);
+					lunix_stat_inc(LUNIX_STAT_CRC_ERRORS);
+					debug("Bad CRC 0x%04x, dropping packet\n", state->crc);
+					lunix_protocol_show_packet(state);
+				}
+				state->pos = 0;
+				state->next_is_special = 0;
+				set_state(state, SEEKING_START_BYTE, 1, 0);
+			}
+	}
 
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
-		}
+	lunix_protocol_wake_dirty(state);
 
 	return 0;
 }
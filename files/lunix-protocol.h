@@ -19,7 +19,10 @@
  * Application/Protocol specific constants
  */
 #define MAX_PACKET_LEN 300
+#define MAX_PAYLOAD_LEN 29      /* TOSH_DATA_LENGTH of the TinyOS stack XMesh runs on,
+                                   longer payloads can only come from a corrupt length */
 #define PACKET_SIGNATURE_OFFSET 4
+#define PAYLOAD_OFFSET 7
 #define NODE_OFFSET 9
 #define VREF_OFFSET 18
 #define TEMPERATURE_OFFSET 20
@@ -51,14 +54,38 @@ struct lunix_protocol_state_struct
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	struct list_head dirty;         /* Sensors updated by the current batch, to be woken up */
+
+	uint16_t crc;                   /* CRC of the packet received so far */
+	unsigned long crc_errors;       /* Packets dropped for a bad CRC */
+	unsigned long resyncs;          /* Packets dropped for broken framing */
+	unsigned long bytes_skipped;    /* Bytes skipped looking for a start byte */
 };
 
+/*
+ * A chunk of the data passed to lunix_protocol_received_buf(), as the
+ * TTY layer handed it over: it ends right before buf[end], and was
+ * received at timestamp [CLOCK_MONOTONIC, in ns].
+ */
+struct lunix_protocol_chunk {
+	uint32_t end;
+	uint64_t timestamp;
+};
+
+/*
+ * Whether to drop packets with a bad CRC, a module parameter
+ */
+extern bool lunix_crc_check;
+
 /*
  * Function prototypes
  */
+void lunix_protocol_crc_init(void);
 void lunix_protocol_init(struct lunix_protocol_state_struct *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *,
-                                const unsigned char *buf, int count);
+                                const unsigned char *buf, int count,
+                                const struct lunix_protocol_chunk *chunks, int nchunks);
 
 #endif /* __KERNEL__ */
 
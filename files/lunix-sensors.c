@@ -19,16 +19,20 @@
 #include <linux/types.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
 #include <linux/mmzone.h>
+#include <linux/seqlock.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-trace.h"
+#include "lunix-chrdev.h"
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+int lunix_sensor_init(struct lunix_sensor_struct *s, uint16_t nodeid)
 {
 	int i;
 	int ret;
@@ -37,8 +41,17 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	/*
 	 * Initialize structure fields
 	 */
-	spin_lock_init(&s->lock);
-	init_waitqueue_head(&s->wq);
+	s->nodeid = nodeid;
+	seqlock_init(&s->seqlock);
+	s->generation = 0;
+	s->flags = 0;
+	s->status = NULL;
+	INIT_LIST_HEAD(&s->dirty);
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		init_waitqueue_head(&s->wq[i]);
+		seqlock_init(&s->text[i].seqlock);
+		s->text[i].generation = 0;
+	}
 
 	/*
 	 * Allocate one page per measurement buffer
@@ -71,10 +84,237 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 	}
 }
 
+/*
+ * The status of all sensors, see struct lunix_status_struct. Slots are
+ * handed out as sensors show up, and each page of the area is only
+ * allocated along with the first slot in it, so memory scales with the
+ * sensors present. lunix_status_size() is the size of the area once
+ * every possible node id has shown up; lunix_status_pages holds the
+ * address of each of its pages, 0 for those not allocated yet.
+ */
+static unsigned long *lunix_status_pages;
+static DEFINE_MUTEX(lunix_status_lock);
+
+unsigned long lunix_status_size(void)
+{
+	return PAGE_ALIGN(sizeof(struct lunix_status_struct) +
+	                  lunix_sensor_cnt * sizeof(struct lunix_status_slot));
+}
+
+int lunix_status_init(void)
+{
+	/* One 64-byte cacheline per slot, header included, none straddles a page */
+	BUILD_BUG_ON(sizeof(struct lunix_status_struct) != 64);
+	BUILD_BUG_ON(sizeof(struct lunix_status_slot) != 64);
+
+	lunix_status_pages = kcalloc(lunix_status_size() >> PAGE_SHIFT,
+	                             sizeof(*lunix_status_pages), GFP_KERNEL);
+	if (!lunix_status_pages)
+		return -ENOMEM;
+	lunix_status_pages[0] = get_zeroed_page(GFP_KERNEL);
+	if (!lunix_status_pages[0]) {
+		kfree(lunix_status_pages);
+		return -ENOMEM;
+	}
+
+	lunix_status = (struct lunix_status_struct *)lunix_status_pages[0];
+	lunix_status->magic = LUNIX_STATUS_MAGIC;
+	lunix_status->nr_slots = lunix_sensor_cnt;
+	return 0;
+}
+
+void lunix_status_destroy(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < lunix_status_size() >> PAGE_SHIFT; i++)
+		if (lunix_status_pages[i])
+			free_page(lunix_status_pages[i]);
+	kfree(lunix_status_pages);
+}
+
+/*
+ * Returns the address of page pgoff of the status area, for mapping
+ * it to userspace, or 0 if no slot in it has been handed out yet.
+ */
+unsigned long lunix_status_page(unsigned long pgoff)
+{
+	if (pgoff >= lunix_status_size() >> PAGE_SHIFT)
+		return 0;
+	return smp_load_acquire(&lunix_status_pages[pgoff]);
+}
+
+/*
+ * Hands out the next slot of the status area to a sensor that just
+ * showed up. Returns NULL if its page cannot be allocated; the sensor
+ * works all the same, it is just missing from the status area.
+ */
+static struct lunix_status_slot *lunix_status_add(uint16_t nodeid)
+{
+	unsigned long off, pg, p;
+	struct lunix_status_slot *slot;
+
+	slot = NULL;
+	mutex_lock(&lunix_status_lock);
+
+	/* There are never more sensors than slots */
+	off = sizeof(struct lunix_status_struct) +
+	      lunix_status->nr_sensors * sizeof(struct lunix_status_slot);
+	pg = off >> PAGE_SHIFT;
+	if (!lunix_status_pages[pg]) {
+		p = get_zeroed_page(GFP_KERNEL);
+		if (!p) {
+			printk(KERN_WARNING "No memory for the status of sensor %u\n", nodeid);
+			goto out;
+		}
+		smp_store_release(&lunix_status_pages[pg], p);
+	}
+
+	slot = (struct lunix_status_slot *)(lunix_status_pages[pg] + offset_in_page(off));
+	slot->nodeid = nodeid;
+	smp_store_release(&lunix_status->nr_sensors, lunix_status->nr_sensors + 1);
+out:
+	mutex_unlock(&lunix_status_lock);
+	return slot;
+}
+
+/*
+ * Returns the sensor with the given node id, creating it, and its
+ * device nodes, the first time it sends an update or one of its
+ * nodes is opened. Returns NULL if it cannot be created. May sleep.
+ *
+ * Sensors are never removed before the module is unloaded, so the
+ * pointer returned stays valid for as long as anyone can use it.
+ */
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid)
+{
+	int ret;
+	struct lunix_sensor_struct *s, *old;
+
+	s = xa_load(&lunix_sensors, nodeid);
+	if (likely(s))
+		return s;
+
+	debug("creating sensor %u\n", nodeid);
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if ((ret = lunix_sensor_init(s, nodeid)) < 0)
+		goto out_with_sensor;
+
+	/* Someone else may have created it in the meantime */
+	old = xa_cmpxchg(&lunix_sensors, nodeid, NULL, s, GFP_KERNEL);
+	if (xa_is_err(old)) {
+		ret = xa_err(old);
+		goto out_with_sensor;
+	}
+	if (old) {
+		lunix_sensor_destroy(s);
+		kfree(s);
+		return old;
+	}
+
+	WRITE_ONCE(s->status, lunix_status_add(nodeid));
+	lunix_chrdev_sensor_add(s);
+	return s;
+
+out_with_sensor:
+	lunix_sensor_destroy(s);
+	kfree(s);
+out:
+	printk(KERN_ERR "Failed to create sensor %u, ret = %d\n", nodeid, ret);
+	return NULL;
+}
+
+/*
+ * Destroys every sensor created so far
+ */
+void lunix_sensors_destroy(void)
+{
+	unsigned long nodeid;
+	struct lunix_sensor_struct *s;
+
+	xa_for_each(&lunix_sensors, nodeid, s) {
+		lunix_sensor_destroy(s);
+		kfree(s);
+	}
+	xa_destroy(&lunix_sensors);
+}
+
+void lunix_stream_init(struct lunix_stream_struct *st)
+{
+	seqlock_init(&st->seqlock);
+	init_waitqueue_head(&st->wq);
+	st->head = 0;
+}
+
+/*
+ * Append an update of sensor nodeid to the stream of all updates
+ */
+static void lunix_stream_append(struct lunix_stream_struct *st, uint16_t nodeid,
+                                uint16_t batt, uint16_t temp, uint16_t light,
+                                uint64_t timestamp)
+{
+	struct lunix_stream_entry *e;
+
+	write_seqlock(&st->seqlock);
+	e = &st->entries[st->head % LUNIX_STREAM_LEN];
+	e->nodeid = nodeid;
+	e->values[BATT] = batt;
+	e->values[TEMP] = temp;
+	e->values[LIGHT] = light;
+	e->timestamp = timestamp;
+	st->head++;
+	write_sequnlock(&st->seqlock);
+}
+
+/*
+ * Wake up the readers of the stream, once for any number of appends
+ */
+void lunix_stream_wake(struct lunix_stream_struct *st)
+{
+	wake_up_interruptible_poll(&st->wq, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+ * The measurement pages and the status page may be mapped to userspace,
+ * which cannot use the sensor seqlock. Bracket every update with their
+ * sequence counters instead, see struct lunix_msr_data_struct.
+ */
+static inline void lunix_seq_write_begin(uint32_t *seq)
+{
+	WRITE_ONCE(*seq, *seq + 1);
+	smp_wmb();
+}
+
+static inline void lunix_seq_write_end(uint32_t *seq)
+{
+	smp_wmb();
+	WRITE_ONCE(*seq, *seq + 1);
+}
+
+/*
+ * Apply an update received at timestamp [CLOCK_MONOTONIC, in ns].
+ * Does not wake up anyone, the caller has to call lunix_sensor_wake()
+ * and lunix_stream_wake() once it is done with a batch of updates.
+ */
 void lunix_sensor_update(struct lunix_sensor_struct *s,
-                         uint16_t batt, uint16_t temp, uint16_t light)
+                         uint16_t batt, uint16_t temp, uint16_t light,
+                         uint64_t timestamp)
 {
-	spin_lock(&s->lock);
+	int i;
+	uint32_t now;
+	struct lunix_sample *sample;
+	struct lunix_status_slot *slot;
+
+	now = ktime_get_real_seconds();
+	slot = READ_ONCE(s->status);
+	write_seqlock(&s->seqlock);
+
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_seq_write_begin(&s->msr_data[i]->seq);
 
 	/*
 	 * Update the raw values and the relevant timestamps.
@@ -84,13 +324,50 @@ void lunix_sensor_update(struct lunix_sensor_struct *s,
 	s->msr_data[LIGHT]->values[0] = light;
 
 	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = ktime_get_real_seconds();
+	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = now;
+	s->generation++;
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		s->msr_data[i]->generation = s->generation;
+		s->msr_data[i]->timestamp = timestamp;
+	}
 
-	spin_unlock(&s->lock);
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_seq_write_end(&s->msr_data[i]->seq);
+
+	if (slot) {
+		lunix_seq_write_begin(&slot->seq);
+		slot->batt = batt;
+		slot->temp = temp;
+		slot->light = light;
+		slot->generation = s->generation;
+		slot->timestamp = timestamp;
+		lunix_seq_write_end(&slot->seq);
+	}
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Append to the history, overwriting the oldest entry.
 	 */
-	wake_up_interruptible(&s->wq);
+	sample = &s->hist[(s->generation - 1) % LUNIX_SENSOR_HIST];
+	sample->values[BATT] = batt;
+	sample->values[TEMP] = temp;
+	sample->values[LIGHT] = light;
+	sample->timestamp = timestamp;
+
+	write_sequnlock(&s->seqlock);
+	lunix_stat_inc(LUNIX_STAT_UPDATES);
+	trace_lunix_sensor_update(s->nodeid, batt, temp, light, s->generation, timestamp);
+
+	lunix_stream_append(&lunix_stream, s->nodeid, batt, temp, light, timestamp);
+}
+
+/*
+ * Wake up any sleepers who may be waiting on
+ * fresh data from this sensor.
+ */
+void lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+	int i;
+
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		wake_up_interruptible_poll(&s->wq[i], EPOLLIN | EPOLLRDNORM);
 }
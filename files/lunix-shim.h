@@ -0,0 +1,129 @@
+/*
+ * lunix-shim.h
+ *
+ * Just enough of the kernel API to build lunix-protocol.c in
+ * userspace, for lunix-protocol-bench.c. It is force-included
+ * ahead of everything else, and the kernel headers the driver
+ * includes resolve to the empty files the Makefile puts in shim/.
+ */
+
+#ifndef _LUNIX_SHIM_H
+#define _LUNIX_SHIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <endian.h>
+
+#define __KERNEL__
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define __read_mostly
+
+#define KERN_ERR     ""
+#define KERN_WARNING ""
+#define KERN_DEBUG   ""
+#define KERN_CONT    ""
+#define printk(fmt, ...) do { } while (0)
+
+#define le16_to_cpu(x) le16toh(x)
+#define REPEAT_BYTE(x) ((~0ul / 0xff) * (x))
+
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define min3(x, y, z) min(min(x, y), z)
+
+/*
+ * A single CPU. The per-CPU counters of the protocol get defined
+ * here, lunix-stats.c is not built.
+ */
+#define DECLARE_PER_CPU(type, name) type name
+#define this_cpu_inc(var)    ((var)++)
+#define this_cpu_add(var, n) ((var) += (n))
+
+/* Debugging stays off, and tracepoints compile to nothing */
+#define DECLARE_STATIC_KEY_FALSE(name) extern int name
+#define static_branch_unlikely(key) 0
+
+#define TP_PROTO(args...) args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+/* Neither the seqlocks nor the wait queues are touched by the protocol */
+typedef struct { unsigned int seq; } seqlock_t;
+typedef struct { void *head; } wait_queue_head_t;
+struct xarray;
+
+/*
+ * Single-threaded bit operations
+ */
+static inline int test_and_set_bit(long nr, unsigned long *addr)
+{
+	int old = (*addr >> nr) & 1;
+
+	*addr |= 1ul << nr;
+	return old;
+}
+
+static inline int test_and_clear_bit(long nr, unsigned long *addr)
+{
+	int old = (*addr >> nr) & 1;
+
+	*addr &= ~(1ul << nr);
+	return old;
+}
+
+/*
+ * Doubly linked lists
+ */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	new->prev = head->prev;
+	new->next = head;
+	head->prev->next = new;
+	head->prev = new;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	INIT_LIST_HEAD(entry);
+}
+
+#define list_for_each_entry_safe(pos, n, head, member)                          \
+	for (pos = list_entry((head)->next, typeof(*pos), member),              \
+	     n = list_entry(pos->member.next, typeof(*pos), member);            \
+	     &pos->member != (head);                                            \
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+#endif /* _LUNIX_SHIM_H */
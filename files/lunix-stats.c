@@ -0,0 +1,98 @@
+/*
+ * lunix-stats.c
+ *
+ * Hot-path counters for Lunix:TNG, exported
+ * through debugfs, and its tracepoints
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/xarray.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "lunix.h"
+
+#define CREATE_TRACE_POINTS
+#include "lunix-trace.h"
+
+DEFINE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+/* <debugfs>/lunix */
+static struct dentry *lunix_stats_dir;
+
+static const char * const lunix_stat_names[N_LUNIX_STAT] = {
+	[LUNIX_STAT_BYTES]           = "bytes",
+	[LUNIX_STAT_PACKETS]         = "packets",
+	[LUNIX_STAT_PACKETS_DROPPED] = "packets_dropped",
+	[LUNIX_STAT_CRC_ERRORS]      = "crc_errors",
+	[LUNIX_STAT_NODES_DROPPED]   = "nodes_dropped",
+	[LUNIX_STAT_UPDATES]         = "updates",
+	[LUNIX_STAT_WAKEUPS]         = "wakeups",
+	[LUNIX_STAT_WAKEUPS_FILTERED] = "wakeups_filtered",
+	[LUNIX_STAT_READS]           = "reads",
+	[LUNIX_STAT_READS_BLOCKED]   = "reads_blocked"
+};
+
+/*
+ * <debugfs>/lunix/stats: the counters summed up over all CPUs,
+ * one "name value" line each, followed by the complete packets
+ * of every type seen so far.
+ */
+static int lunix_stats_show(struct seq_file *m, void *v)
+{
+	int cpu, i;
+	unsigned long sum;
+
+	for (i = 0; i < N_LUNIX_STAT; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += READ_ONCE(per_cpu(lunix_stats.counters[i], cpu));
+		seq_printf(m, "%s %lu\n", lunix_stat_names[i], sum);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lunix_stats.packet_types); i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += READ_ONCE(per_cpu(lunix_stats.packet_types[i], cpu));
+		if (sum)
+			seq_printf(m, "packet_type_0x%02x %lu\n", i, sum);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lunix_stats);
+
+/*
+ * <debugfs>/lunix/sensors: the updates received by every
+ * sensor so far, one "nodeid updates" line each.
+ */
+static int lunix_stats_sensors_show(struct seq_file *m, void *v)
+{
+	unsigned long nodeid;
+	struct lunix_sensor_struct *s;
+
+	xa_for_each(&lunix_sensors, nodeid, s)
+		seq_printf(m, "%lu %lu\n", nodeid, READ_ONCE(s->generation));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lunix_stats_sensors);
+
+/*
+ * Failing to create the debugfs files is not an error,
+ * the counters are kept up to date either way.
+ */
+void lunix_stats_init(void)
+{
+	lunix_stats_dir = debugfs_create_dir("lunix", NULL);
+	debugfs_create_file("stats", 0444, lunix_stats_dir, NULL, &lunix_stats_fops);
+	debugfs_create_file("sensors", 0444, lunix_stats_dir, NULL, &lunix_stats_sensors_fops);
+}
+
+void lunix_stats_destroy(void)
+{
+	debugfs_remove_recursive(lunix_stats_dir);
+}
@@ -0,0 +1,133 @@
+/*
+ * lunix-trace.h
+ *
+ * Tracepoints for Lunix:TNG, under events/lunix/
+ * in tracefs, for use with ftrace or perf
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lunix
+
+#if !defined(_LUNIX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LUNIX_TRACE_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * A complete XMesh packet has been received, with a good CRC or not
+ */
+TRACE_EVENT(lunix_packet,
+
+	TP_PROTO(unsigned char type, int payload_length, bool crc_ok),
+
+	TP_ARGS(type, payload_length, crc_ok),
+
+	TP_STRUCT__entry(
+		__field(unsigned char, type)
+		__field(int, payload_length)
+		__field(bool, crc_ok)
+	),
+
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->payload_length = payload_length;
+		__entry->crc_ok = crc_ok;
+	),
+
+	TP_printk("type=0x%02x payload_length=%d crc_ok=%d",
+	          __entry->type, __entry->payload_length, __entry->crc_ok)
+);
+
+/*
+ * An update has been applied to a sensor
+ */
+TRACE_EVENT(lunix_sensor_update,
+
+	TP_PROTO(uint16_t nodeid, uint16_t batt, uint16_t temp, uint16_t light,
+	         unsigned long generation, uint64_t timestamp),
+
+	TP_ARGS(nodeid, batt, temp, light, generation, timestamp),
+
+	TP_STRUCT__entry(
+		__field(uint16_t, nodeid)
+		__field(uint16_t, batt)
+		__field(uint16_t, temp)
+		__field(uint16_t, light)
+		__field(unsigned long, generation)
+		__field(uint64_t, timestamp)
+	),
+
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->batt = batt;
+		__entry->temp = temp;
+		__entry->light = light;
+		__entry->generation = generation;
+		__entry->timestamp = timestamp;
+	),
+
+	TP_printk("nodeid=%u batt=0x%04x temp=0x%04x light=0x%04x generation=%lu timestamp=%llu",
+	          __entry->nodeid, __entry->batt, __entry->temp, __entry->light,
+	          __entry->generation, (unsigned long long)__entry->timestamp)
+);
+
+/*
+ * A blocking reader of a sensor node is being woken up
+ */
+TRACE_EVENT(lunix_chrdev_wake,
+
+	TP_PROTO(uint16_t nodeid, int type, unsigned long generation),
+
+	TP_ARGS(nodeid, type, generation),
+
+	TP_STRUCT__entry(
+		__field(uint16_t, nodeid)
+		__field(int, type)
+		__field(unsigned long, generation)
+	),
+
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->type = type;
+		__entry->generation = generation;
+	),
+
+	TP_printk("nodeid=%u type=%d generation=%lu",
+	          __entry->nodeid, __entry->type, __entry->generation)
+);
+
+/*
+ * A read of a sensor node returns
+ */
+TRACE_EVENT(lunix_chrdev_read,
+
+	TP_PROTO(uint16_t nodeid, int type, ssize_t ret),
+
+	TP_ARGS(nodeid, type, ret),
+
+	TP_STRUCT__entry(
+		__field(uint16_t, nodeid)
+		__field(int, type)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->type = type;
+		__entry->ret = ret;
+	),
+
+	TP_printk("nodeid=%u type=%d ret=%zd",
+	          __entry->nodeid, __entry->type, __entry->ret)
+);
+
+#endif /* _LUNIX_TRACE_H */
+
+/* Outside the include guard, define_trace.h reads this file again */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lunix-trace
+#include <trace/define_trace.h>
@@ -18,7 +18,11 @@
 #include <linux/fs.h>
 #include <linux/tty.h>
 #include <linux/kernel.h>
+#include <linux/seqlock.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/xarray.h>
 
 /*
  * A structure representing a hardware sensor
@@ -28,7 +32,40 @@
 #define LUNIX_MSR_MAGIC 0xF00DF00D
 
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+
+/*
+ * Number of past updates kept per sensor, for readers
+ * that need every sample and not just the latest one.
+ */
+#define LUNIX_SENSOR_HIST 64
+
+/*
+ * A single update of a sensor, as kept in its history
+ */
+struct lunix_sample {
+	uint64_t timestamp;
+	uint16_t values[N_LUNIX_MSR];
+};
+
+/*
+ * The text rendering of the latest value of a measurement,
+ * shared by everyone reading it. generation is the number of
+ * the sensor update it belongs to, zero if there is none yet.
+ */
+#define LUNIX_MSR_TEXT_LEN 20
+
+struct lunix_msr_text_struct {
+	seqlock_t seqlock;
+	unsigned long generation;
+	long value;
+	int len;
+	unsigned char data[LUNIX_MSR_TEXT_LEN];
+};
+
 struct lunix_sensor_struct {
+	/* XMesh node id of the sensor, starting from 1 */
+	uint16_t nodeid;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -36,42 +73,159 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Seqlock used to publish updates from the serial line discipline
+	 * to the character device driver. Writers serialize on its
+	 * spinlock; readers never block them, they just retry whenever
+	 * an update raced with their copy.
+	 */
+	seqlock_t seqlock;
+
+	/*
+	 * The generation counts every update ever applied to this sensor.
+	 * It is what readers compare to find out whether there is anything
+	 * fresh, no matter how many updates arrive within the same second
+	 * or how the wall clock jumps. The most recent updates are kept
+	 * too, update n (counting from zero) in hist[n % LUNIX_SENSOR_HIST]
+	 * until it is overwritten. Both are protected by the seqlock above.
+	 */
+	unsigned long generation;
+	struct lunix_sample hist[LUNIX_SENSOR_HIST];
+
+	/*
+	 * Formatted latest values, filled in lazily by the first reader
+	 * after each update. Kept apart from the fields written on every
+	 * update, since readers of a busy sensor hit them all the time.
+	 */
+	struct lunix_msr_text_struct text[N_LUNIX_MSR] ____cacheline_aligned_in_smp;
+
+	/*
+	 * Lists of processes waiting to be woken up when this sensor
+	 * has been updated with new data, one per measurement. Every
+	 * update touches all measurements, so each update goes through
+	 * all of them; what keeps readers asleep is the wake function of
+	 * blocking reads, which only lets the wakeup through when their
+	 * view of the measurement they follow changed.
+	 */
+	wait_queue_head_t wq[N_LUNIX_MSR];
+
+	/*
+	 * Slot of the sensor in the status area, NULL until it has
+	 * been handed one, or if there was no memory for it.
 	 */
-	spinlock_t lock;
+	struct lunix_status_slot *status;
 
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * Waking up readers is deferred to the end of each batch of
+	 * data received from the serial line. Updated sensors are marked
+	 * with LUNIX_SENSOR_DIRTY and queued on the dirty list of the
+	 * protocol state that owns the bit.
 	 */
+	unsigned long flags;
+	struct list_head dirty;
+};
+
+#define LUNIX_SENSOR_DIRTY 0    /* Bit in flags */
+
+/*
+ * A stream of the updates of all sensors, in the order they were applied,
+ * feeding the aggregate /dev/lunix-all node. head counts every update
+ * ever appended; update n lives in entries[n % LUNIX_STREAM_LEN] until it
+ * is overwritten. Entries and head are published through the seqlock.
+ */
+#define LUNIX_STREAM_LEN 1024
+
+struct lunix_stream_entry {
+	uint64_t timestamp;
+	uint16_t nodeid;
+	uint16_t values[N_LUNIX_MSR];
+};
+
+struct lunix_stream_struct {
+	seqlock_t seqlock;
+	unsigned long head;
+	struct lunix_stream_entry entries[LUNIX_STREAM_LEN];
 	wait_queue_head_t wq;
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default value for the maximum number of sensors supported,
+ * i.e. the largest node id accepted. Sensors are only created on
+ * the first update they send, in the lunix_sensors xarray,
+ * indexed by node id.
  */
 #define LUNIX_SENSOR_CNT 16
+#define LUNIX_SENSOR_MAX 65535  /* Node ids are 16-bit */
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+extern struct xarray lunix_sensors;
+extern struct lunix_stream_struct lunix_stream;
+extern struct lunix_status_struct *lunix_status;
 
 /*
- * Debugging
+ * Counters of the hot paths, kept per CPU so that bumping one costs
+ * next to nothing. They are only summed up when someone reads them,
+ * through <debugfs>/lunix/stats. The updates each sensor received
+ * are not counted here, its generation already does that.
  */
-#if LUNIX_DEBUG
-#define debug(fmt,arg...)     printk(KERN_DEBUG "%s: " fmt, __func__ , ##arg)
-#else
-#define debug(fmt,arg...)     do { } while(0)
-#endif
+enum lunix_stat_enum {
+	LUNIX_STAT_BYTES = 0,           /* Bytes received from the serial line */
+	LUNIX_STAT_PACKETS,             /* Complete packets, with a good CRC */
+	LUNIX_STAT_PACKETS_DROPPED,     /* Packets with a bad CRC or broken framing */
+	LUNIX_STAT_CRC_ERRORS,          /* Packets with a bad CRC, of the above */
+	LUNIX_STAT_NODES_DROPPED,       /* Updates of node ids out of bounds,
+	                                   or of sensors that could not be created */
+	LUNIX_STAT_UPDATES,             /* Sensor updates applied */
+	LUNIX_STAT_WAKEUPS,             /* Blocking readers woken up */
+	LUNIX_STAT_WAKEUPS_FILTERED,    /* Blocking readers left asleep,
+	                                   with nothing to report */
+	LUNIX_STAT_READS,               /* Reads that returned data */
+	LUNIX_STAT_READS_BLOCKED,       /* Reads that had to sleep first */
+	N_LUNIX_STAT
+};
+
+struct lunix_stats_struct {
+	unsigned long counters[N_LUNIX_STAT];
+	unsigned long packet_types[256];        /* Complete packets, by type */
+};
+
+DECLARE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+#define lunix_stat_inc(stat)          this_cpu_inc(lunix_stats.counters[stat])
+#define lunix_stat_add(stat, n)       this_cpu_add(lunix_stats.counters[stat], n)
+#define lunix_stat_packet_type(type)  this_cpu_inc(lunix_stats.packet_types[type])
+
+/*
+ * Debugging, turned on and off at runtime through the lunix_debug
+ * module parameter. While off, a debug() statement is a single no-op
+ * instruction and none of its arguments are evaluated.
+ */
+DECLARE_STATIC_KEY_FALSE(lunix_debug_key);
+
+#define lunix_debugging()     static_branch_unlikely(&lunix_debug_key)
+#define debug(fmt,arg...)                                                \
+	do {                                                             \
+		if (lunix_debugging())                                   \
+			printk(KERN_DEBUG "%s: " fmt, __func__ , ##arg); \
+	} while(0)
 
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
+int lunix_sensor_init(struct lunix_sensor_struct *, uint16_t nodeid);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid);
+void lunix_sensors_destroy(void);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
-                         uint16_t batt, uint16_t temp, uint16_t light);
+                         uint16_t batt, uint16_t temp, uint16_t light,
+                         uint64_t timestamp);
+void lunix_sensor_wake(struct lunix_sensor_struct *s);
+void lunix_stream_init(struct lunix_stream_struct *);
+void lunix_stream_wake(struct lunix_stream_struct *);
+int lunix_status_init(void);
+void lunix_status_destroy(void);
+unsigned long lunix_status_size(void);
+unsigned long lunix_status_page(unsigned long pgoff);
+void lunix_stats_init(void);
+void lunix_stats_destroy(void);
 
 #else
 #include <inttypes.h>
@@ -80,13 +234,119 @@ void lunix_sensor_update(struct lunix_sensor_struct *s,
  * A structure, living at the start of a page, containing a version number
  * [timestamp of last update] and a variable number of 32-bit quantities. It is
  * meant to be mappable to userspace.
+ *
+ * last_update is the wall-clock time of the update in seconds since the
+ * Epoch. generation counts the updates of the sensor, and timestamp is the
+ * CLOCK_MONOTONIC time, in nanoseconds, the update was received at.
+ *
+ * The page is updated in place. The writer bumps seq to an odd value before
+ * touching the rest of the structure and back to an even value when done,
+ * so a reader can detect (and retry) a torn snapshot without any locking.
  */
 struct lunix_msr_data_struct {
 	uint32_t magic;
 	uint32_t last_update;
+	uint32_t seq;
+	uint32_t reserved;
+	uint64_t generation;
+	uint64_t timestamp;
 	uint32_t values[];
 };
 
+/*
+ * The status of the whole sensor network, mappable to userspace through
+ * /dev/lunix-status. A header is followed by a packed array of slots,
+ * one per sensor present, in the order the sensors showed up. Only the
+ * first nr_sensors slots are in use, and can be accessed: load it with
+ * acquire semantics, it never goes down. There is room for nr_slots,
+ * but the pages beyond the last slot in use take up no memory and
+ * cannot be accessed, so map the whole area once and re-read
+ * nr_sensors to find sensors that show up later.
+ *
+ * Each slot takes up a cacheline of its own, and is updated in place
+ * under its seq counter, the same way as struct lunix_msr_data_struct.
+ * batt, temp and light are raw 16-bit values, as received from the
+ * sensor. Convert them to milli-units the same way the driver does:
+ * through the lookup tables of lunix-lookup.h, generated by
+ * mk-lunix-lookup, for batt and temp up to LUNIX_LOOKUP_MAX
+ * [LUNIX_BATT_SCALE / batt and LUNIX_TEMP_INVALID above it], and
+ * as light * LUNIX_LIGHT_SCALE / 0xFFFF for light.
+ */
+#define LUNIX_STATUS_MAGIC 0x5EA5F00D
+
+struct lunix_status_slot {
+	uint32_t seq;
+	uint16_t nodeid;
+	uint16_t batt;
+	uint16_t temp;
+	uint16_t light;
+	uint32_t reserved;
+	uint64_t generation;
+	uint64_t timestamp;
+	uint8_t pad[32];
+};
+
+struct lunix_status_struct {
+	uint32_t magic;
+	uint32_t nr_slots;
+	uint32_t nr_sensors;
+	uint8_t pad[52];
+	struct lunix_status_slot slots[];
+};
+
+#ifndef __KERNEL__
+/*
+ * Take a consistent snapshot of the most recent value in a mapped
+ * measurement page. Returns the generation of the snapshot,
+ * so that callers can tell whether anything changed since last time.
+ */
+static inline uint64_t lunix_msr_snapshot(const struct lunix_msr_data_struct *msr,
+                                          uint32_t *value, uint64_t *timestamp)
+{
+	uint32_t seq;
+	uint64_t generation;
+
+	for (;;) {
+		seq = __atomic_load_n(&msr->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		*value = __atomic_load_n(&msr->values[0], __ATOMIC_RELAXED);
+		*timestamp = __atomic_load_n(&msr->timestamp, __ATOMIC_RELAXED);
+		generation = __atomic_load_n(&msr->generation, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&msr->seq, __ATOMIC_RELAXED) == seq)
+			return generation;
+	}
+}
+
+/*
+ * Take a consistent snapshot of a slot of the mapped status page into copy.
+ * Returns its generation, zero if the sensor has not shown up yet.
+ */
+static inline uint64_t lunix_status_snapshot(const struct lunix_status_slot *slot,
+                                             struct lunix_status_slot *copy)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		copy->nodeid = __atomic_load_n(&slot->nodeid, __ATOMIC_RELAXED);
+		copy->batt = __atomic_load_n(&slot->batt, __ATOMIC_RELAXED);
+		copy->temp = __atomic_load_n(&slot->temp, __ATOMIC_RELAXED);
+		copy->light = __atomic_load_n(&slot->light, __ATOMIC_RELAXED);
+		copy->generation = __atomic_load_n(&slot->generation, __ATOMIC_RELAXED);
+		copy->timestamp = __atomic_load_n(&slot->timestamp, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			copy->seq = seq;
+			return copy->generation;
+		}
+	}
+}
+#endif /* __KERNEL__ */
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
@@ -6,9 +6,20 @@ mknod /dev/ttyS1 c 4 65
 mknod /dev/ttyS2 c 4 66
 mknod /dev/ttyS3 c 4 67
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
-for sensor in $(seq 0 1 15); do
+# Lunix:TNG nodes are created by the module itself, through devtmpfs/udev:
+# /dev/lunix-all and /dev/lunix-status on load, /dev/lunix<N>-{batt,temp,light} as soon as the
+# sensor with node id N + 1 sends its first update.
+#
+# Without devtmpfs, make them by hand. The module parameter lunix_sensor_cnt
+# (default 16) is the largest node id; the aggregate node sits right past it.
+cnt=${1:-16}
+for sensor in $(seq 0 1 $[$cnt - 1]); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# Aggregate nodes, right past the last sensor: every update of every sensor,
+# and the mappable status of all sensors.
+mknod /dev/lunix-all c 60 $[$cnt * 8 + 0]
+mknod /dev/lunix-status c 60 $[$cnt * 8 + 1]
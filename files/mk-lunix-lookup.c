@@ -14,6 +14,18 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+/*
+ * Largest raw value of the 10-bit ADC of the sensors
+ */
+#define LOOKUP_MAX 1023
+
+/*
+ * Constants of the closed-form conversions
+ */
+#define LIGHT_SCALE  5000000L   /* Light level at raw value 0xFFFF */
+#define BATT_SCALE   1251129L   /* 1.223V * 1023 [ADC full scale], in mV */
+#define TEMP_INVALID -272150L   /* Returned for meaningless values */
+
 /*
  * Translates the received uint16_t value to voltage level
  */
@@ -63,7 +75,7 @@ long uint16_to_temp(uint16_t value)
 	l = (long)(res * 1000);
 
 	/* Useless values */
-	return (l < -272150) ?  -272150 : l;
+	return (l < TEMP_INVALID) ?  TEMP_INVALID : l;
 }
 
 int main(void)
@@ -80,44 +92,60 @@ int main(void)
 	        " * Instead of doing floating-point in kernelspace,\n"
 	        " * use the following lookup tables to convert 16-bit\n"
 	        " * raw measurements to floating point values.\n"
+	        " *\n"
+	        " * The sensors use a 10-bit ADC, so the tables only cover\n"
+	        " * raw values up to LUNIX_LOOKUP_MAX. Anything above it\n"
+	        " * takes the out-of-range path of the conversion code.\n"
 	        " */\n"
 	        "\n"
-	        "long lookup_temperature[65536] = {\n", __FILE__);
+	        "#define LUNIX_LOOKUP_MAX %u\n"
+	        "\n"
+	        "static const int32_t lookup_temperature[LUNIX_LOOKUP_MAX + 1] = {\n",
+	        __FILE__, LOOKUP_MAX);
 
 	/*
 	 * Temperature
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LOOKUP_MAX - 3; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 		        uint16_to_temp(i), uint16_to_temp(i+1),
 		        uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LOOKUP_MAX - 3) ? ",\n" : "\n");
 	}
 
-	fprintf(stdout, "};\n\nlong lookup_voltage[65536] = {\n");
+	fprintf(stdout, "};\n\nstatic const int32_t lookup_voltage[LUNIX_LOOKUP_MAX + 1] = {\n");
 
 	/*
 	 * Battery Voltage
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LOOKUP_MAX - 3; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 			uint16_to_batt(i), uint16_to_batt(i+1),
 			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LOOKUP_MAX - 3) ? ",\n" : "\n");
 	}
-	fprintf(stdout, "};\n\nlong lookup_light[65536] = {\n");
+	fprintf(stdout, "};\n\n");
 
 	/*
-	 * Light
+	 * Light is a linear conversion, no table needed. Check that the
+	 * closed forms used by the kernel for light and for out-of-range
+	 * battery and temperature values agree with the reference ones.
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-		        uint16_to_light(i), uint16_to_light(i+1),
-		        uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+	for (i = 0; i <= 0xFFFF; i++) {
+		if (uint16_to_light(i) != (long)((uint64_t)i * LIGHT_SCALE / 0xFFFF) ||
+		    (i > 0 && uint16_to_batt(i) != BATT_SCALE / (long)i) ||
+		    (i > LOOKUP_MAX && uint16_to_temp(i) != TEMP_INVALID)) {
+			fprintf(stderr, "%s: closed form disagrees for raw value %u\n",
+			        __FILE__, i);
+			return 1;
+		}
 	}
 
-	fprintf(stdout, "};\n\n");
+	fprintf(stdout,
+	        "#define LUNIX_LIGHT_SCALE %ldULL\n"
+	        "#define LUNIX_BATT_SCALE %ldL\n"
+	        "#define LUNIX_TEMP_INVALID %ldL\n\n",
+	        LIGHT_SCALE, BATT_SCALE, TEMP_INVALID);
 
 	return 0;
 }